@@ -0,0 +1,119 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <string>
+
+#include "dataLoader.h"
+
+// Loads a volume on a background thread. A cheap preview is published
+// first so the viewer can show something, then the full resolution volume
+// replaces it. Errors are kept for the viewer to show, they are not thrown
+// into the render loop.
+class AsyncVolumeLoader {
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable published_cond;
+    // set on destruction, checked between the stages and by the readers the
+    // load functions hand it to through LoadOptions::cancel
+    std::atomic<bool> &cancel;
+    Volume published;
+    bool has_new = false;
+    bool published_full = false;
+    bool done = false;
+    std::string error;
+
+    void publish(const Volume &volume, bool full)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        published = volume;
+        published_full = full;
+        has_new = true;
+        published_cond.notify_all();
+    }
+
+public:
+    AsyncVolumeLoader(std::function<Volume()> load_preview,
+                      std::function<Volume()> load_full,
+                      std::atomic<bool> &cancel)
+        : cancel(cancel)
+    {
+        worker = std::thread([this, load_preview, load_full]() {
+            try {
+                if (load_preview) {
+                    publish(load_preview(), false);
+                }
+                if (this->cancel) {
+                    throw LoadCancelled();
+                }
+                publish(load_full(), true);
+            } catch (const LoadCancelled &) {
+            } catch (const std::exception &e) {
+                std::lock_guard<std::mutex> guard(lock);
+                error = e.what();
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(lock);
+                error = "unknown error";
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            done = true;
+            published_cond.notify_all();
+        });
+    }
+
+    AsyncVolumeLoader(const AsyncVolumeLoader &) = delete;
+    AsyncVolumeLoader &operator=(const AsyncVolumeLoader &) = delete;
+
+    ~AsyncVolumeLoader()
+    {
+        cancel = true;
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // Take the latest published volume if there is one we have not seen,
+    // full tells whether it is the final resolution
+    bool poll(Volume &volume, bool &full)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!has_new) {
+            return false;
+        }
+        volume = published;
+        full = published_full;
+        has_new = false;
+        return true;
+    }
+
+    // Block until the first volume (preview or full) is available, throws
+    // if the load failed before publishing anything
+    Volume wait_first(bool &full)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        published_cond.wait(guard, [this]() { return has_new || done; });
+        if (!has_new) {
+            throw std::runtime_error(error.empty() ? "Load cancelled" : error);
+        }
+        has_new = false;
+        full = published_full;
+        return published;
+    }
+
+    bool finished()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return done;
+    }
+
+    // Why the load failed, empty while it is running or if it succeeded
+    std::string failure()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return error;
+    }
+};
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cmath>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+
+#include "rkcommon/math/vec.h"
+
+#include "dataLoader.h"
+#include "persistence.h"
+#include "json.hpp"
+
+using namespace rkcommon::math;
+
+// Barcode file (.cvbar), little endian:
+//   BarcodeFileHeader
+//   BarcodeRecord[n_pairs], most persistent first
+// The records are used straight from a read-only mapping. Voxel indices and
+// void sizes refer to a volume of the header dims and are only meaningful
+// when the matching flag is set.
+
+const char BARCODE_FILE_MAGIC[4] = {'C', 'V', 'B', 'C'};
+const uint32_t BARCODE_FILE_VERSION = 1;
+// birth_voxel and death_voxel are set
+const uint32_t BARCODE_HAS_VOXELS = 1;
+// void_voxels is set
+const uint32_t BARCODE_HAS_VOID_SIZES = 2;
+
+struct BarcodeFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t n_pairs;
+    int32_t dims[3];
+    uint32_t flags;
+};
+
+struct BarcodeRecord {
+    float birth;
+    float death;
+    // representative voxels, NO_VOXEL when unknown or for components that never die
+    uint64_t birth_voxel;
+    uint64_t death_voxel;
+    // voxels of the void before it merges, 0 when unknown
+    uint64_t void_voxels;
+
+    float persistence() const
+    {
+        return std::fabs(death - birth);
+    }
+};
+
+static_assert(sizeof(BarcodeFileHeader) == 32, "BarcodeFileHeader layout changed");
+static_assert(sizeof(BarcodeRecord) == 32, "BarcodeRecord layout changed");
+
+// Persistence pairs, either mapped from a barcode file or held in memory
+class Barcode {
+    std::shared_ptr<MappedFile> mapping;
+    std::shared_ptr<std::vector<BarcodeRecord>> owned;
+    const BarcodeRecord *records = nullptr;
+    size_t n_pairs = 0;
+
+public:
+    vec3i dims{0};
+    uint32_t flags = 0;
+
+    Barcode() = default;
+
+    // Takes the records, sorting them most persistent first
+    Barcode(std::vector<BarcodeRecord> pairs, const vec3i &dims, uint32_t flags)
+        : owned(std::make_shared<std::vector<BarcodeRecord>>(std::move(pairs))), dims(dims), flags(flags)
+    {
+        std::stable_sort(owned->begin(), owned->end(), [](const BarcodeRecord &a, const BarcodeRecord &b) {
+            return a.persistence() > b.persistence();
+        });
+        records = owned->data();
+        n_pairs = owned->size();
+    }
+
+    // Maps a barcode file, the records stay on disk until they are touched
+    explicit Barcode(const std::string &fname) : mapping(std::make_shared<MappedFile>(fname))
+    {
+        BarcodeFileHeader header;
+        if (mapping->size() < sizeof(BarcodeFileHeader)) {
+            throw std::runtime_error(fname + " is not a barcode file");
+        }
+        std::memcpy(&header, mapping->data(), sizeof(BarcodeFileHeader));
+        if (std::memcmp(header.magic, BARCODE_FILE_MAGIC, 4) != 0) {
+            throw std::runtime_error(fname + " is not a barcode file");
+        }
+        if (header.version != BARCODE_FILE_VERSION) {
+            throw std::runtime_error("Unsupported barcode version in " + fname);
+        }
+        // n_pairs is bounded first, the product could wrap around
+        const size_t record_bytes = mapping->size() - sizeof(BarcodeFileHeader);
+        if (header.n_pairs > record_bytes / sizeof(BarcodeRecord)
+            || header.n_pairs * sizeof(BarcodeRecord) != record_bytes) {
+            throw std::runtime_error("Size of " + fname + " does not match its " + std::to_string(header.n_pairs)
+                                     + " pairs");
+        }
+        records = reinterpret_cast<const BarcodeRecord *>(mapping->data() + sizeof(BarcodeFileHeader));
+        n_pairs = header.n_pairs;
+        dims = vec3i(header.dims[0], header.dims[1], header.dims[2]);
+        flags = header.flags;
+    }
+
+    size_t size() const
+    {
+        return n_pairs;
+    }
+
+    bool empty() const
+    {
+        return n_pairs == 0;
+    }
+
+    const BarcodeRecord &operator[](size_t i) const
+    {
+        return records[i];
+    }
+
+    const BarcodeRecord *begin() const
+    {
+        return records;
+    }
+
+    const BarcodeRecord *end() const
+    {
+        return records + n_pairs;
+    }
+};
+
+// Pairs of a merge tree with their voxels, and the void sizes when it has labels
+Barcode make_barcode(const MergeTree &tree)
+{
+    const std::vector<PersistencePair> pairs = tree.pairs();
+    std::vector<BarcodeRecord> records(pairs.size());
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        const PersistencePair &pair = pairs[i];
+        records[i] = BarcodeRecord{pair.birth, pair.death, pair.birth_voxel, pair.death_voxel,
+                                   tree.void_size(pair.branch)};
+    }
+    return Barcode(std::move(records), tree.dims,
+                   BARCODE_HAS_VOXELS | (tree.has_labels() ? BARCODE_HAS_VOID_SIZES : 0));
+}
+
+void write_barcode_file(const Barcode &barcode, const std::string &fname)
+{
+    BarcodeFileHeader header;
+    std::memset(&header, 0, sizeof(BarcodeFileHeader));
+    std::memcpy(header.magic, BARCODE_FILE_MAGIC, 4);
+    header.version = BARCODE_FILE_VERSION;
+    header.n_pairs = barcode.size();
+    header.dims[0] = barcode.dims.x;
+    header.dims[1] = barcode.dims.y;
+    header.dims[2] = barcode.dims.z;
+    header.flags = barcode.flags;
+
+    std::ofstream fout(fname.c_str(), std::ios::binary);
+    if (!fout) {
+        throw std::runtime_error("Failed to open " + fname + " for writing");
+    }
+    fout.write(reinterpret_cast<const char *>(&header), sizeof(BarcodeFileHeader));
+    fout.write(reinterpret_cast<const char *>(barcode.begin()), barcode.size() * sizeof(BarcodeRecord));
+    if (!fout) {
+        throw std::runtime_error("Failed to write barcode " + fname);
+    }
+}
+
+// Collects {"birth": b, "death": d} objects at any depth of a JSON
+// document, other keys are skipped. Nothing but the pairs is kept in memory.
+class BarcodeJsonSax : public nlohmann::json_sax<nlohmann::json> {
+    struct Scope {
+        bool is_object;
+        std::string key;
+        float birth;
+        float death;
+        int found;
+    };
+    std::vector<Scope> scopes;
+
+    bool number(double value)
+    {
+        if (!scopes.empty() && scopes.back().is_object) {
+            Scope &scope = scopes.back();
+            if (scope.key == "birth") {
+                scope.birth = float(value);
+                scope.found |= 1;
+            } else if (scope.key == "death") {
+                scope.death = float(value);
+                scope.found |= 2;
+            }
+        }
+        return true;
+    }
+
+public:
+    std::vector<BarcodeRecord> pairs;
+    std::string error;
+
+    bool null() override
+    {
+        return true;
+    }
+
+    bool boolean(bool) override
+    {
+        return true;
+    }
+
+    bool number_integer(number_integer_t value) override
+    {
+        return number(double(value));
+    }
+
+    bool number_unsigned(number_unsigned_t value) override
+    {
+        return number(double(value));
+    }
+
+    bool number_float(number_float_t value, const string_t &) override
+    {
+        return number(value);
+    }
+
+    bool string(string_t &) override
+    {
+        return true;
+    }
+
+    bool binary(binary_t &) override
+    {
+        return true;
+    }
+
+    bool start_object(std::size_t) override
+    {
+        scopes.push_back(Scope{true, std::string(), 0.f, 0.f, 0});
+        return true;
+    }
+
+    bool key(string_t &key) override
+    {
+        scopes.back().key = key;
+        return true;
+    }
+
+    bool end_object() override
+    {
+        if (scopes.back().found == 3) {
+            pairs.push_back(BarcodeRecord{scopes.back().birth, scopes.back().death, NO_VOXEL, NO_VOXEL, 0});
+        }
+        scopes.pop_back();
+        return true;
+    }
+
+    bool start_array(std::size_t) override
+    {
+        scopes.push_back(Scope{false, std::string(), 0.f, 0.f, 0});
+        return true;
+    }
+
+    bool end_array() override
+    {
+        scopes.pop_back();
+        return true;
+    }
+
+    bool parse_error(std::size_t position, const std::string &, const nlohmann::detail::exception &e) override
+    {
+        error = e.what() + std::string(" at byte ") + std::to_string(position);
+        return false;
+    }
+};
+
+// Legacy JSON barcodes, an array or object of {"birth", "death"} objects
+Barcode import_json_barcode(const std::string &fname)
+{
+    std::ifstream fin(fname.c_str(), std::ios::binary);
+    if (!fin) {
+        throw std::runtime_error("Cannot open barcode " + fname);
+    }
+    BarcodeJsonSax sax;
+    if (!nlohmann::json::sax_parse(fin, &sax)) {
+        throw std::runtime_error("Failed to parse barcode " + fname + ": " + sax.error);
+    }
+    return Barcode(std::move(sax.pairs), vec3i(0), 0);
+}
+
+// Barcode file, or a legacy .json barcode
+Barcode load_barcode(const std::string &fname)
+{
+    auto start = std::chrono::steady_clock::now();
+    const bool is_json = fname.size() >= 5 && fname.compare(fname.size() - 5, 5, ".json") == 0;
+    Barcode barcode = is_json ? import_json_barcode(fname) : Barcode(fname);
+    std::cout << barcode.size() << " pairs from " << fname << " in " << seconds_since(start) << " s" << std::endl;
+    return barcode;
+}
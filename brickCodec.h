@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+#include <zlib.h>
+
+// Lossless brick codecs for .cvb files. Bricks are byte shuffled first, so
+// the exponent and high mantissa bytes of neighbouring voxels sit next to
+// each other, then deflated. Smooth float fields compress several times.
+
+enum class BrickCodec : uint32_t { NONE = 0, SHUFFLE_ZLIB = 1 };
+
+// Speed over ratio, decoding has to outrun the disk
+const int BRICK_ZLIB_LEVEL = 1;
+
+// Byte plane b of the output holds byte b of every element
+void shuffle_bytes(const uint8_t *in, size_t n_elements, size_t element_size, uint8_t *out)
+{
+    for (size_t i = 0; i < n_elements; ++i) {
+        for (size_t b = 0; b < element_size; ++b) {
+            out[b * n_elements + i] = in[i * element_size + b];
+        }
+    }
+}
+
+void unshuffle_bytes(const uint8_t *in, size_t n_elements, size_t element_size, uint8_t *out)
+{
+    for (size_t b = 0; b < element_size; ++b) {
+        const uint8_t *plane = in + b * n_elements;
+        for (size_t i = 0; i < n_elements; ++i) {
+            out[i * element_size + b] = plane[i];
+        }
+    }
+}
+
+// Encodes a brick of n_elements voxels, returns the stored payload
+std::vector<uint8_t> encode_brick(const uint8_t *voxels, size_t n_elements, size_t element_size, BrickCodec codec)
+{
+    const size_t n_bytes = n_elements * element_size;
+    if (codec == BrickCodec::NONE) {
+        return std::vector<uint8_t>(voxels, voxels + n_bytes);
+    }
+    std::vector<uint8_t> shuffled(n_bytes);
+    shuffle_bytes(voxels, n_elements, element_size, shuffled.data());
+
+    uLongf packed_bytes = compressBound(n_bytes);
+    std::vector<uint8_t> packed(packed_bytes);
+    if (compress2(packed.data(), &packed_bytes, shuffled.data(), n_bytes, BRICK_ZLIB_LEVEL) != Z_OK) {
+        throw std::runtime_error("Failed to compress brick");
+    }
+    packed.resize(packed_bytes);
+    return packed;
+}
+
+// Decodes a stored payload into out, which holds n_elements voxels
+void decode_brick(const uint8_t *payload,
+                  size_t payload_bytes,
+                  size_t n_elements,
+                  size_t element_size,
+                  BrickCodec codec,
+                  uint8_t *out)
+{
+    const size_t n_bytes = n_elements * element_size;
+    if (codec == BrickCodec::NONE) {
+        std::memcpy(out, payload, n_bytes);
+        return;
+    }
+    // one scratch buffer per worker thread, bricks are decoded concurrently
+    thread_local std::vector<uint8_t> shuffled;
+    shuffled.resize(n_bytes);
+    uLongf unpacked_bytes = n_bytes;
+    if (uncompress(shuffled.data(), &unpacked_bytes, payload, payload_bytes) != Z_OK
+        || unpacked_bytes != n_bytes) {
+        throw std::runtime_error("Corrupt compressed brick");
+    }
+    unshuffle_bytes(shuffled.data(), n_elements, element_size, out);
+}
+
+BrickCodec parse_brick_codec(const std::string &name)
+{
+    if (name == "none") {
+        return BrickCodec::NONE;
+    } else if (name == "zlib") {
+        return BrickCodec::SHUFFLE_ZLIB;
+    }
+    throw std::runtime_error("Unknown brick codec " + name);
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+#include "rkcommon/math/vec.h"
+#include "rkcommon/tasking/parallel_for.h"
+
+#include "dataLoader.h"
+
+using namespace rkcommon::math;
+
+// Voxel bounds [lower, upper) of brick b of a brick grid over dims
+void brick_bounds(const BrickRanges &bricks, const vec3i &dims, size_t b, vec3i &lower, vec3i &upper)
+{
+    const vec3i brick(int(b % bricks.grid.x),
+                      int((b / bricks.grid.x) % bricks.grid.y),
+                      int(b / (size_t(bricks.grid.x) * bricks.grid.y)));
+    lower = brick * bricks.brick_size;
+    upper = min(lower + bricks.brick_size, dims);
+}
+
+// The per-brick min/max of a volume sorted by min and by max, so threshold
+// queries are a binary search plus a walk over the bricks they return.
+// Bricks with no finite voxels have an empty range and are never returned.
+class BrickIntervals {
+    std::shared_ptr<const BrickRanges> bricks;
+    std::vector<size_t> by_min;
+    std::vector<float> sorted_min;
+    std::vector<size_t> by_max;
+    std::vector<float> sorted_max;
+
+public:
+    BrickIntervals() = default;
+
+    explicit BrickIntervals(const std::shared_ptr<const BrickRanges> &bricks) : bricks(bricks)
+    {
+        const std::vector<vec2f> &ranges = bricks->ranges;
+        for (size_t b = 0; b < ranges.size(); ++b) {
+            if (ranges[b].x <= ranges[b].y) {
+                by_min.push_back(b);
+            }
+        }
+        by_max = by_min;
+        std::sort(by_min.begin(), by_min.end(), [&](size_t a, size_t b) { return ranges[a].x < ranges[b].x; });
+        std::sort(by_max.begin(), by_max.end(), [&](size_t a, size_t b) { return ranges[a].y < ranges[b].y; });
+        for (size_t b : by_min) {
+            sorted_min.push_back(ranges[b].x);
+        }
+        for (size_t b : by_max) {
+            sorted_max.push_back(ranges[b].y);
+        }
+    }
+
+    bool empty() const
+    {
+        return !bricks;
+    }
+
+    const BrickRanges &ranges() const
+    {
+        return *bricks;
+    }
+
+    size_t n_bricks() const
+    {
+        return bricks ? bricks->ranges.size() : 0;
+    }
+
+    // Bricks holding values in [lo, hi]
+    std::vector<size_t> overlapping(float lo, float hi) const
+    {
+        std::vector<size_t> result;
+        const size_t n = std::upper_bound(sorted_min.begin(), sorted_min.end(), hi) - sorted_min.begin();
+        for (size_t i = 0; i < n; ++i) {
+            if (bricks->ranges[by_min[i]].y >= lo) {
+                result.push_back(by_min[i]);
+            }
+        }
+        return result;
+    }
+
+    // Bricks whose values are all < threshold
+    std::vector<size_t> below(float threshold) const
+    {
+        const size_t n = std::lower_bound(sorted_max.begin(), sorted_max.end(), threshold) - sorted_max.begin();
+        return std::vector<size_t>(by_max.begin(), by_max.begin() + n);
+    }
+
+    // Bricks with values on both sides of threshold
+    std::vector<size_t> straddling(float threshold) const
+    {
+        std::vector<size_t> result;
+        const size_t n = std::lower_bound(sorted_min.begin(), sorted_min.end(), threshold) - sorted_min.begin();
+        for (size_t i = 0; i < n; ++i) {
+            if (bricks->ranges[by_min[i]].y >= threshold) {
+                result.push_back(by_min[i]);
+            }
+        }
+        return result;
+    }
+};
+
+struct CountBelowFn {
+    const Volume &volume;
+    const BrickRanges &bricks;
+    const std::vector<size_t> &scan;
+    float threshold;
+    std::atomic<size_t> count;
+
+    template <typename T>
+    void operator()(const T *voxels)
+    {
+        rkcommon::tasking::parallel_for(scan.size(), [&](size_t i) {
+            vec3i lower, upper;
+            brick_bounds(bricks, volume.dims, scan[i], lower, upper);
+            size_t below = 0;
+            for (int z = lower.z; z < upper.z; ++z) {
+                for (int y = lower.y; y < upper.y; ++y) {
+                    const T *row = voxels + (size_t(z) * volume.dims.y + y) * volume.dims.x;
+                    for (int x = lower.x; x < upper.x; ++x) {
+                        below += volume.decode(float(row[x])) < threshold;
+                    }
+                }
+            }
+            count += below;
+        });
+    }
+};
+
+struct ThresholdCount {
+    size_t voxels = 0;
+    // bricks whose voxels had to be visited
+    size_t bricks_scanned = 0;
+};
+
+// Voxels with value < threshold. Bricks entirely above are skipped, bricks
+// entirely below are counted from their size, only the straddling ones are
+// scanned. The brick ranges leave out NaN and Inf voxels, so bricks holding
+// any are scanned as well: NaN and +Inf are never below, -Inf always is.
+// Without per-brick counts a volume with such voxels is scanned whole.
+ThresholdCount count_voxels_below(const Volume &volume, const BrickIntervals &intervals, float threshold)
+{
+    ThresholdCount result;
+    const BrickRanges &bricks = intervals.ranges();
+    std::vector<size_t> scan;
+    if (!bricks.knows_non_finite() && (volume.stats.n_nan > 0 || volume.stats.n_inf > 0)) {
+        for (size_t b = 0; b < bricks.ranges.size(); ++b) {
+            scan.push_back(b);
+        }
+    } else {
+        scan = intervals.straddling(threshold);
+        std::vector<uint8_t> listed(bricks.ranges.size(), 0);
+        for (size_t b : scan) {
+            listed[b] = 1;
+        }
+        for (size_t b : intervals.below(threshold)) {
+            listed[b] = 1;
+            if (bricks.knows_non_finite() && bricks.n_nan[b] + bricks.n_inf[b] > 0) {
+                scan.push_back(b);
+                continue;
+            }
+            vec3i lower, upper;
+            brick_bounds(bricks, volume.dims, b, lower, upper);
+            const vec3i size = upper - lower;
+            result.voxels += size_t(size.x) * size.y * size.z;
+        }
+        // bricks above the threshold or without finite voxels may hold -Inf
+        for (size_t b = 0; b < listed.size() && bricks.knows_non_finite(); ++b) {
+            if (!listed[b] && bricks.n_inf[b] > 0) {
+                scan.push_back(b);
+            }
+        }
+    }
+    CountBelowFn count_fn{volume, intervals.ranges(), scan, threshold, {0}};
+    dispatch_voxels(volume, count_fn);
+    result.voxels += count_fn.count;
+    result.bricks_scanned = scan.size();
+    return result;
+}
@@ -0,0 +1,609 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include <cmath>
+#include <memory>
+#include <limits>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "rkcommon/math/vec.h"
+#include "rkcommon/tasking/parallel_for.h"
+
+#include "dataLoader.h"
+#include "volumeStats.h"
+#include "brickCodec.h"
+#include "volumeQuantize.h"
+
+using namespace rkcommon::math;
+
+// Bricked volume file (.cvb), little endian:
+//   BrickFileHeader
+//   BrickInfo[n_bricks], bricks ordered x-fastest over the brick grid
+//   brick payloads, each one x-fastest over its own extent
+// Edge bricks are clipped to the volume, so no padding is stored. Payloads
+// are encoded with the header codec, or stored plain when that does not
+// shrink them (BrickInfo::codec). BrickInfo::bytes is the stored size.
+// Quantized files store uint8/uint16 codes per brick spanning that brick's
+// [min, max], readers re-express them in one affine over the whole volume.
+
+const char BRICK_FILE_MAGIC[4] = {'C', 'V', 'B', 'K'};
+// Version 1 files lack the quantization fields and end the header early
+const uint32_t BRICK_FILE_VERSION = 2;
+const int DEFAULT_BRICK_SIZE = 64;
+
+struct BrickFileHeader {
+    char magic[4];
+    uint32_t version;
+    int32_t dims[3];
+    uint32_t voxel_type;
+    uint32_t brick_size;
+    uint32_t codec;
+    uint64_t n_bricks;
+    uint32_t quantized;
+    uint32_t reserved;
+};
+
+struct BrickInfo {
+    int32_t origin[3];
+    int32_t size[3];
+    float min;
+    float max;
+    float mean;
+    uint32_t codec;
+    uint64_t offset;
+    uint64_t bytes;
+
+    size_t n_voxels() const
+    {
+        return size_t(size[0]) * size_t(size[1]) * size_t(size[2]);
+    }
+};
+
+static_assert(sizeof(BrickFileHeader) == 48, "BrickFileHeader layout changed");
+
+size_t brick_header_bytes(uint32_t version)
+{
+    return version == 1 ? 40 : sizeof(BrickFileHeader);
+}
+static_assert(sizeof(BrickInfo) == 56, "BrickInfo layout changed");
+
+vec3i brick_grid_dims(const vec3i &dims, int brick_size)
+{
+    return vec3i((dims.x + brick_size - 1) / brick_size,
+                 (dims.y + brick_size - 1) / brick_size,
+                 (dims.z + brick_size - 1) / brick_size);
+}
+
+// Brick extents for a volume, offsets and stats are left empty
+std::vector<BrickInfo> make_brick_layout(const vec3i &dims, int brick_size)
+{
+    const vec3i grid = brick_grid_dims(dims, brick_size);
+    std::vector<BrickInfo> bricks;
+    bricks.reserve(size_t(grid.x) * grid.y * grid.z);
+    for (int bz = 0; bz < grid.z; ++bz) {
+        for (int by = 0; by < grid.y; ++by) {
+            for (int bx = 0; bx < grid.x; ++bx) {
+                BrickInfo brick;
+                std::memset(&brick, 0, sizeof(BrickInfo));
+                const int origin[3] = {bx * brick_size, by * brick_size, bz * brick_size};
+                const int extent[3] = {dims.x, dims.y, dims.z};
+                for (int i = 0; i < 3; ++i) {
+                    brick.origin[i] = origin[i];
+                    brick.size[i] = std::min(brick_size, extent[i] - origin[i]);
+                }
+                bricks.push_back(brick);
+            }
+        }
+    }
+    return bricks;
+}
+
+// Copy the voxels of one brick out of (or back into) a dense x-fastest volume
+template <typename T>
+void gather_brick(const T *dense, const vec3i &dims, const BrickInfo &brick, T *out)
+{
+    for (int z = 0; z < brick.size[2]; ++z) {
+        for (int y = 0; y < brick.size[1]; ++y) {
+            const size_t src = (size_t(brick.origin[2] + z) * dims.y + brick.origin[1] + y) * dims.x
+                + brick.origin[0];
+            std::memcpy(out, dense + src, brick.size[0] * sizeof(T));
+            out += brick.size[0];
+        }
+    }
+}
+
+template <typename T>
+void scatter_brick(const T *in, const vec3i &dims, const BrickInfo &brick, T *dense)
+{
+    for (int z = 0; z < brick.size[2]; ++z) {
+        for (int y = 0; y < brick.size[1]; ++y) {
+            const size_t dst = (size_t(brick.origin[2] + z) * dims.y + brick.origin[1] + y) * dims.x
+                + brick.origin[0];
+            std::memcpy(dense + dst, in, brick.size[0] * sizeof(T));
+            in += brick.size[0];
+        }
+    }
+}
+
+struct BrickWriteOptions {
+    int brick_size = DEFAULT_BRICK_SIZE;
+    BrickCodec codec = BrickCodec::NONE;
+    // store uint8/uint16 codes with a per brick affine
+    bool quantize = false;
+    VoxelType quantized_type = VoxelType::UINT16;
+};
+
+// Gathers and encodes a batch of bricks and fills in their min/max/mean
+struct BrickBatchFn {
+    const Volume &volume;
+    std::vector<BrickInfo> &bricks;
+    size_t first;
+    size_t count;
+    const BrickWriteOptions &options;
+    std::vector<std::vector<uint8_t>> &payloads;
+
+    template <typename T>
+    void operator()(const T *voxels)
+    {
+        rkcommon::tasking::parallel_for(count, [&](size_t i) {
+            BrickInfo &brick = bricks[first + i];
+            std::vector<T> gathered(brick.n_voxels());
+            gather_brick(voxels, volume.dims, brick, gathered.data());
+            const ScanChunk stats = scan_voxels<T, false>(gathered.data(), nullptr, brick.n_voxels());
+            brick.min = volume.decode(stats.lo);
+            brick.max = volume.decode(stats.hi);
+            brick.mean = volume.decode(float(stats.mean));
+
+            const uint8_t *raw = reinterpret_cast<const uint8_t *>(gathered.data());
+            size_t element_size = sizeof(T);
+            std::vector<uint8_t> codes;
+            if (options.quantize) {
+                element_size = voxel_type_size(options.quantized_type);
+                codes.resize(brick.n_voxels() * element_size);
+                const float scale = quantized_scale(brick.min, brick.max, options.quantized_type);
+                if (options.quantized_type == VoxelType::UINT8) {
+                    quantize_voxels(gathered.data(), brick.n_voxels(), volume.value_offset, volume.value_scale,
+                                    brick.min, scale, codes.data());
+                } else {
+                    quantize_voxels(gathered.data(), brick.n_voxels(), volume.value_offset, volume.value_scale,
+                                    brick.min, scale, reinterpret_cast<uint16_t *>(codes.data()));
+                }
+                raw = codes.data();
+            }
+            const size_t raw_bytes = brick.n_voxels() * element_size;
+            payloads[i] = encode_brick(raw, brick.n_voxels(), element_size, options.codec);
+            brick.codec = uint32_t(options.codec);
+            if (payloads[i].size() >= raw_bytes) {
+                payloads[i] = encode_brick(raw, brick.n_voxels(), element_size, BrickCodec::NONE);
+                brick.codec = uint32_t(BrickCodec::NONE);
+            }
+            brick.bytes = payloads[i].size();
+        });
+    }
+};
+
+// Number of bricks gathered in parallel before they are written out
+const size_t BRICK_WRITE_BATCH = 256;
+
+void write_bricked_volume(const Volume &volume,
+                          const std::string &fname,
+                          const BrickWriteOptions &write_options = BrickWriteOptions())
+{
+    // Codes of a quantized volume only make sense with their affine, keep them quantized
+    BrickWriteOptions options = write_options;
+    if (!options.quantize && (volume.value_scale != 1.f || volume.value_offset != 0.f)) {
+        options.quantize = true;
+        options.quantized_type = volume.voxel_type;
+    }
+    const int brick_size = options.brick_size;
+    if (brick_size <= 0) {
+        throw std::runtime_error("Brick size must be positive, got " + std::to_string(brick_size));
+    }
+    std::vector<BrickInfo> bricks = make_brick_layout(volume.dims, brick_size);
+
+    BrickFileHeader header;
+    std::memset(&header, 0, sizeof(BrickFileHeader));
+    std::memcpy(header.magic, BRICK_FILE_MAGIC, 4);
+    header.version = BRICK_FILE_VERSION;
+    header.dims[0] = volume.dims.x;
+    header.dims[1] = volume.dims.y;
+    header.dims[2] = volume.dims.z;
+    header.voxel_type = uint32_t(options.quantize ? options.quantized_type : volume.voxel_type);
+    header.brick_size = brick_size;
+    header.codec = uint32_t(options.codec);
+    header.n_bricks = bricks.size();
+    header.quantized = options.quantize;
+
+    std::ofstream fout(fname.c_str(), std::ios::binary);
+    if (!fout) {
+        throw std::runtime_error("Failed to open " + fname + " for writing");
+    }
+    // The brick table is rewritten once the stats and stored sizes are known
+    fout.write(reinterpret_cast<const char *>(&header), sizeof(BrickFileHeader));
+    fout.write(reinterpret_cast<const char *>(bricks.data()), bricks.size() * sizeof(BrickInfo));
+
+    const uint64_t data_start = sizeof(BrickFileHeader) + bricks.size() * sizeof(BrickInfo);
+    uint64_t offset = data_start;
+    std::vector<std::vector<uint8_t>> payloads(BRICK_WRITE_BATCH);
+    for (size_t first = 0; first < bricks.size(); first += BRICK_WRITE_BATCH) {
+        const size_t count = std::min(BRICK_WRITE_BATCH, bricks.size() - first);
+        BrickBatchFn batch_fn{volume, bricks, first, count, options, payloads};
+        dispatch_voxels(volume, batch_fn);
+        for (size_t i = 0; i < count; ++i) {
+            bricks[first + i].offset = offset;
+            offset += payloads[i].size();
+            fout.write(reinterpret_cast<const char *>(payloads[i].data()), payloads[i].size());
+        }
+    }
+
+    fout.seekp(sizeof(BrickFileHeader));
+    fout.write(reinterpret_cast<const char *>(bricks.data()), bricks.size() * sizeof(BrickInfo));
+    if (!fout) {
+        throw std::runtime_error("Failed to write bricked volume " + fname);
+    }
+    if (options.quantize) {
+        float max_error = 0.f;
+        for (const auto &brick : bricks) {
+            max_error = std::max(max_error, quantized_scale(brick.min, brick.max, options.quantized_type) / 2.f);
+        }
+        std::cout << "quantized bricks to " << voxel_type_size(options.quantized_type) * 8
+                  << " bits, max error " << max_error << std::endl;
+    }
+    if (options.codec != BrickCodec::NONE) {
+        const size_t raw_bytes = volume.n_voxels() * volume.voxel_size();
+        const size_t stored_bytes = offset - data_start;
+        std::cout << "compressed " << raw_bytes << " to " << stored_bytes << " bytes ("
+                  << double(raw_bytes) / stored_bytes << "x)" << std::endl;
+    }
+}
+
+// Random access to the bricks of a .cvb file through positional reads
+class BrickedVolumeFile {
+    int fd = -1;
+    BrickFileHeader header;
+    std::vector<BrickInfo> brick_table;
+    // affine shared by all bricks of a quantized file
+    float global_offset = 0.f;
+    float global_scale = 1.f;
+
+    // Re-express the codes of brick i from its own affine in the global one
+    void requantize_brick(size_t i, void *codes) const
+    {
+        const BrickInfo &brick = brick_table[i];
+        const float scale = quantized_scale(brick.min, brick.max, voxel_type());
+        if (voxel_type() == VoxelType::UINT8) {
+            uint8_t *q = static_cast<uint8_t *>(codes);
+            quantize_voxels(q, brick.n_voxels(), brick.min, scale, global_offset, global_scale, q);
+        } else {
+            uint16_t *q = static_cast<uint16_t *>(codes);
+            quantize_voxels(q, brick.n_voxels(), brick.min, scale, global_offset, global_scale, q);
+        }
+    }
+
+public:
+    BrickedVolumeFile(const std::string &fname)
+    {
+        fd = open(fname.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open bricked volume " + fname);
+        }
+        auto fail = [&](const std::string &message) {
+            close(fd);
+            fd = -1;
+            throw std::runtime_error(message);
+        };
+        std::memset(&header, 0, sizeof(BrickFileHeader));
+        if (pread(fd, &header, sizeof(BrickFileHeader), 0) < ssize_t(brick_header_bytes(1))
+            || std::memcmp(header.magic, BRICK_FILE_MAGIC, 4) != 0) {
+            fail(fname + " is not a bricked volume");
+        }
+        if (header.version != 1 && header.version != BRICK_FILE_VERSION) {
+            fail("Unsupported bricked volume version in " + fname);
+        }
+        if (header.version == 1) {
+            header.quantized = 0;
+            header.reserved = 0;
+        }
+        if (header.codec > uint32_t(BrickCodec::SHUFFLE_ZLIB)) {
+            fail("Unsupported brick codec in " + fname);
+        }
+        if (header.voxel_type > uint32_t(VoxelType::FLOAT64)
+            || (header.quantized && voxel_type() != VoxelType::UINT8 && voxel_type() != VoxelType::UINT16)) {
+            fail("Unsupported voxel type in " + fname);
+        }
+        if (header.brick_size == 0 || header.brick_size > uint32_t(std::numeric_limits<int>::max())
+            || header.dims[0] <= 0 || header.dims[1] <= 0 || header.dims[2] <= 0) {
+            fail("Invalid dims or brick size in " + fname);
+        }
+        // the table must be exactly the layout the writer makes for these dims
+        const std::vector<BrickInfo> layout = make_brick_layout(dims(), brick_size());
+        if (header.n_bricks != layout.size()) {
+            fail("Brick count of " + fname + " does not match its dims");
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            fail("Failed to stat bricked volume " + fname);
+        }
+        const uint64_t file_bytes = st.st_size;
+        brick_table.resize(header.n_bricks);
+        const size_t table_bytes = brick_table.size() * sizeof(BrickInfo);
+        if (pread(fd, brick_table.data(), table_bytes, brick_header_bytes(header.version)) != ssize_t(table_bytes)) {
+            fail("Failed to read brick table of " + fname);
+        }
+        const size_t voxel_bytes = voxel_type_size(voxel_type());
+        for (size_t i = 0; i < brick_table.size(); ++i) {
+            const BrickInfo &brick = brick_table[i];
+            if (std::memcmp(brick.origin, layout[i].origin, sizeof(brick.origin)) != 0
+                || std::memcmp(brick.size, layout[i].size, sizeof(brick.size)) != 0) {
+                fail("Brick " + std::to_string(i) + " of " + fname + " does not match the brick grid");
+            }
+            if (brick.codec > uint32_t(BrickCodec::SHUFFLE_ZLIB)
+                || (BrickCodec(brick.codec) == BrickCodec::NONE && brick.bytes != brick.n_voxels() * voxel_bytes)) {
+                fail("Brick " + std::to_string(i) + " of " + fname + " has an invalid codec or size");
+            }
+            if (brick.offset > file_bytes || brick.bytes > file_bytes - brick.offset) {
+                fail("Brick " + std::to_string(i) + " of " + fname + " lies past the end of the file");
+            }
+        }
+        if (quantized()) {
+            const VolumeStats stats = brick_stats();
+            global_offset = stats.range.x;
+            global_scale = quantized_scale(stats.range.x, stats.range.y, voxel_type());
+        }
+    }
+
+    BrickedVolumeFile(const BrickedVolumeFile &) = delete;
+    BrickedVolumeFile &operator=(const BrickedVolumeFile &) = delete;
+
+    ~BrickedVolumeFile()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    vec3i dims() const
+    {
+        return vec3i(header.dims[0], header.dims[1], header.dims[2]);
+    }
+
+    VoxelType voxel_type() const
+    {
+        return VoxelType(header.voxel_type);
+    }
+
+    int brick_size() const
+    {
+        return header.brick_size;
+    }
+
+    BrickCodec codec() const
+    {
+        return BrickCodec(header.codec);
+    }
+
+    bool quantized() const
+    {
+        return header.quantized != 0;
+    }
+
+    // Affine of the codes handed out by read_brick, value = offset + scale * code
+    float value_offset() const
+    {
+        return global_offset;
+    }
+
+    float value_scale() const
+    {
+        return global_scale;
+    }
+
+    // Worst case error of a value read back: the brick and global rounding
+    float quantization_error() const
+    {
+        if (!quantized()) {
+            return 0.f;
+        }
+        float brick_error = 0.f;
+        for (const auto &brick : brick_table) {
+            brick_error = std::max(brick_error, quantized_scale(brick.min, brick.max, voxel_type()) / 2.f);
+        }
+        return brick_error + global_scale / 2.f;
+    }
+
+    const std::vector<BrickInfo> &bricks() const
+    {
+        return brick_table;
+    }
+
+    // Decoded size of brick i
+    size_t brick_bytes(size_t i) const
+    {
+        return brick_table[i].n_voxels() * voxel_type_size(voxel_type());
+    }
+
+    // Bytes of brick payloads on disk
+    size_t stored_bytes() const
+    {
+        size_t total = 0;
+        for (const auto &brick : brick_table) {
+            total += brick.bytes;
+        }
+        return total;
+    }
+
+    // Read the voxels of brick i into dst, which holds at least brick_bytes(i).
+    // Compressed bricks are decoded on the calling thread, quantized ones come
+    // back in the global affine.
+    void read_brick(size_t i, void *dst) const
+    {
+        const BrickInfo &brick = brick_table[i];
+        const BrickCodec brick_codec = BrickCodec(brick.codec);
+        thread_local std::vector<uint8_t> payload;
+        uint8_t *out = static_cast<uint8_t *>(dst);
+        if (brick_codec != BrickCodec::NONE) {
+            payload.resize(brick.bytes);
+            out = payload.data();
+        }
+        pread_all(fd, out, brick.bytes, brick.offset);
+        if (brick_codec != BrickCodec::NONE) {
+            decode_brick(payload.data(),
+                         brick.bytes,
+                         brick.n_voxels(),
+                         voxel_type_size(voxel_type()),
+                         brick_codec,
+                         static_cast<uint8_t *>(dst));
+        }
+        if (quantized()) {
+            requantize_brick(i, dst);
+        }
+    }
+
+    // Range and mean of the whole volume from the brick headers. The headers
+    // only describe the finite voxels and do not count the others, so the
+    // NaN and Inf voxels per brick come from a scan (see ScatterBricksFn).
+    // Without them every voxel is taken as finite and the counts are only
+    // approximate.
+    VolumeStats brick_stats(const std::vector<uint32_t> &n_nan = std::vector<uint32_t>(),
+                            const std::vector<uint32_t> &n_inf = std::vector<uint32_t>()) const
+    {
+        VolumeStats stats;
+        const bool counted = n_nan.size() == brick_table.size() && n_inf.size() == brick_table.size();
+        double sum = 0.0;
+        for (size_t i = 0; i < brick_table.size(); ++i) {
+            const BrickInfo &brick = brick_table[i];
+            const size_t n_finite = counted ? brick.n_voxels() - n_nan[i] - n_inf[i] : brick.n_voxels();
+            if (counted) {
+                stats.n_nan += n_nan[i];
+                stats.n_inf += n_inf[i];
+            }
+            // bricks without finite voxels have no range or mean
+            if (n_finite == 0) {
+                continue;
+            }
+            stats.range = stats.n_finite == 0 ? vec2f(brick.min, brick.max)
+                                              : vec2f(std::min(stats.range.x, brick.min), std::max(stats.range.y, brick.max));
+            sum += double(brick.mean) * n_finite;
+            stats.n_finite += n_finite;
+        }
+        if (stats.n_finite > 0) {
+            stats.mean = sum / stats.n_finite;
+        }
+        return stats;
+    }
+
+    // The brick headers as a min/max summary, with the NaN and Inf counts of
+    // a scan if there was one
+    BrickRanges brick_ranges(const std::vector<uint32_t> &n_nan = std::vector<uint32_t>(),
+                             const std::vector<uint32_t> &n_inf = std::vector<uint32_t>()) const
+    {
+        BrickRanges ranges;
+        ranges.brick_size = header.brick_size;
+        ranges.grid = brick_grid_dims(dims(), header.brick_size);
+        ranges.ranges.reserve(brick_table.size());
+        for (const auto &brick : brick_table) {
+            ranges.ranges.push_back(vec2f(brick.min, brick.max));
+        }
+        ranges.n_nan = n_nan;
+        ranges.n_inf = n_inf;
+        return ranges;
+    }
+};
+
+// Reassembles the dense volume from its bricks in parallel, counting the
+// NaN and Inf voxels of every brick while it is at hand
+struct ScatterBricksFn {
+    const BrickedVolumeFile &file;
+    const vec3i dims;
+    void *dense;
+    std::vector<uint32_t> n_nan;
+    std::vector<uint32_t> n_inf;
+
+    template <typename T>
+    void operator()(const T *)
+    {
+        const auto &bricks = file.bricks();
+        n_nan.assign(bricks.size(), 0);
+        n_inf.assign(bricks.size(), 0);
+        rkcommon::tasking::parallel_for(bricks.size(), [&](size_t i) {
+            std::vector<T> buffer(bricks[i].n_voxels());
+            file.read_brick(i, buffer.data());
+            scatter_brick(buffer.data(), dims, bricks[i], static_cast<T *>(dense));
+            if (!std::numeric_limits<T>::is_integer) {
+                for (const T &x : buffer) {
+                    n_nan[i] += std::isnan(x);
+                    n_inf[i] += std::isinf(x);
+                }
+            }
+        });
+    }
+};
+
+Volume load_bricked_volume(const std::string &fname)
+{
+    BrickedVolumeFile file(fname);
+
+    Volume volume;
+    volume.dims = file.dims();
+    volume.voxel_type = file.voxel_type();
+    volume.value_offset = file.value_offset();
+    volume.value_scale = file.value_scale();
+
+    const size_t n_bytes = volume.n_voxels() * volume.voxel_size();
+    auto start = std::chrono::steady_clock::now();
+    auto voxels = allocate_buffer<uint8_t>(n_bytes, "bricked volume");
+    volume.voxel_data = std::shared_ptr<const void>(voxels, voxels->data());
+    ScatterBricksFn scatter_fn{file, volume.dims, voxels->data(), {}, {}};
+    dispatch_voxels(volume, scatter_fn);
+    // Effective throughput, counted in decoded bytes
+    print_throughput("read bricks", n_bytes, seconds_since(start));
+    if (file.codec() != BrickCodec::NONE) {
+        std::cout << "read " << file.stored_bytes() << " compressed bytes for " << n_bytes << std::endl;
+    }
+
+    // The brick headers already hold the range, only the histogram needs a scan
+    volume.stats = file.brick_stats(scatter_fn.n_nan, scatter_fn.n_inf);
+    VolumeHistogramFn histogram_fn{volume, volume.stats};
+    dispatch_voxels(volume, histogram_fn);
+    volume.brick_ranges = std::make_shared<BrickRanges>(file.brick_ranges(scatter_fn.n_nan, scatter_fn.n_inf));
+    volume.range = volume.stats.range;
+    std::cout << "volume range: " << volume.range << ", mean: " << volume.stats.mean << std::endl;
+    if (volume.stats.n_nan > 0 || volume.stats.n_inf > 0) {
+        std::cout << "volume has " << volume.stats.n_nan << " NaN and " << volume.stats.n_inf << " Inf voxels"
+                  << std::endl;
+    }
+    if (file.quantized()) {
+        std::cout << "quantized to " << volume.voxel_size() * 8 << " bits, max error "
+                  << file.quantization_error() << std::endl;
+    }
+    return volume;
+}
+
+// Preview built from the brick means alone, one voxel per brick
+Volume load_brick_preview(const BrickedVolumeFile &file)
+{
+    const std::vector<BrickInfo> &bricks = file.bricks();
+
+    Volume volume;
+    volume.dims = brick_grid_dims(file.dims(), file.brick_size());
+    volume.spacing = vec3f(float(file.brick_size()));
+    volume.voxel_type = VoxelType::FLOAT32;
+
+    auto means = allocate_buffer<float>(bricks.size(), "brick preview");
+    for (size_t i = 0; i < bricks.size(); ++i) {
+        (*means)[i] = bricks[i].mean;
+    }
+    volume.voxel_data = std::shared_ptr<const void>(means, means->data());
+    volume.stats = file.brick_stats();
+    VolumeHistogramFn histogram_fn{volume, volume.stats};
+    dispatch_voxels(volume, histogram_fn);
+    volume.range = volume.stats.range;
+    return volume;
+}
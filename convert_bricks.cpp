@@ -0,0 +1,51 @@
+// Converts a raw, .npy, .nrrd/.nhdr or JSON described volume into the bricked .cvb format
+//   convert_bricks -f volume.raw -dims X Y Z -dtype float64 -o volume.cvb [-brick 64] [-mmap]
+//   convert_bricks -f volume.npy -o volume.cvb [-codec none|zlib] [-quantize uint8|uint16]
+
+#include <iostream>
+
+#include "parseArgs.h"
+#include "dataLoader.h"
+#include "volumeFormats.h"
+#include "brickedVolume.h"
+
+int main(int argc, const char **argv)
+{
+    Args args;
+    parseArgs(argc, argv, args);
+    if (args.filename.empty() || args.output.empty()) {
+        std::cout << "Usage: " << argv[0]
+                  << " -f volume.raw -dims X Y Z -dtype type -o volume.cvb [-brick size] [-codec none|zlib] [-quantize uint8|uint16] [-mmap]\n"
+                  << "       " << argv[0] << " -f volume.npy|nrrd|nhdr|json -o volume.cvb [-brick size] [-codec none|zlib] [-quantize uint8|uint16] [-mmap]"
+                  << std::endl;
+        return 1;
+    }
+
+    try {
+        LoadOptions load_options;
+        load_options.use_mmap = args.mmap;
+        load_options.to_float32 = args.to_float32;
+        load_options.use_cache = args.use_cache;
+        load_options.read_streams = args.read_streams;
+        load_options.readahead = args.readahead;
+        const RawVolumeLayout layout = describe_volume_file(args.filename, args.extension, args.dims, args.dtype);
+        Volume volume = load_raw_volume(layout, load_options);
+
+        auto start = std::chrono::steady_clock::now();
+        BrickWriteOptions write_options;
+        write_options.brick_size = args.brick_size;
+        write_options.codec = parse_brick_codec(args.codec);
+        write_options.quantize = !args.quantize.empty();
+        if (write_options.quantize) {
+            write_options.quantized_type = parse_voxel_type(args.quantize);
+            // throws unless uint8 or uint16
+            quantized_max(write_options.quantized_type);
+        }
+        write_bricked_volume(volume, args.output, write_options);
+        print_throughput("write bricks", volume.n_voxels() * volume.voxel_size(), seconds_since(start));
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -5,81 +5,423 @@
 #include <iterator>
 #include <vector>
 #include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <cmath>
+#include <cstring>
+#include <atomic>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "rkcommon/math/vec.h"
+#include "rkcommon/tasking/parallel_for.h"
+
+#include "volumeStats.h"
+#include "volumeCache.h"
+#include "parallelReader.h"
+#include "residentBuffers.h"
 
 using namespace rkcommon::math;
 
+enum class VoxelType { UINT8, UINT16, FLOAT32, FLOAT64 };
+
+VoxelType parse_voxel_type(const std::string &voxel_type)
+{
+    if (voxel_type == "uint8") {
+        return VoxelType::UINT8;
+    } else if (voxel_type == "uint16") {
+        return VoxelType::UINT16;
+    } else if (voxel_type == "float32") {
+        return VoxelType::FLOAT32;
+    } else if (voxel_type == "float64") {
+        return VoxelType::FLOAT64;
+    }
+    throw std::runtime_error("Unrecognized voxel type " + voxel_type);
+}
+
+size_t voxel_type_size(VoxelType voxel_type)
+{
+    switch (voxel_type) {
+    case VoxelType::UINT8:
+        return 1;
+    case VoxelType::UINT16:
+        return 2;
+    case VoxelType::FLOAT32:
+        return 4;
+    case VoxelType::FLOAT64:
+        return 8;
+    }
+    return 0;
+}
+
 struct Volume {
     vec3i dims;
     vec2f range;
     vec3f spacing{1.f};
     vec3f origin{0.f};
-    std::shared_ptr<std::vector<float>> voxel_data = nullptr;
+    VolumeStats stats;
+    // min/max per brick, may be null if the loader did not compute it
+    std::shared_ptr<const BrickRanges> brick_ranges = nullptr;
+    VoxelType voxel_type = VoxelType::FLOAT32;
+    // Voxels stored as voxel_type, either an owned buffer or an alias of a read-only file mapping
+    std::shared_ptr<const void> voxel_data = nullptr;
+    // Quantized volumes store integer codes, value = value_offset + value_scale * code.
+    // range, stats and brick_ranges are always in values.
+    float value_scale = 1.f;
+    float value_offset = 0.f;
 
     size_t n_voxels() const
     {
         return size_t(dims.x) * size_t(dims.y) * size_t(dims.z);
     }
+
+    size_t voxel_size() const
+    {
+        return voxel_type_size(voxel_type);
+    }
+
+    template <typename T>
+    const T *voxels() const
+    {
+        return static_cast<const T *>(voxel_data.get());
+    }
+
+    // Stored voxel to value and back
+    float decode(float stored) const
+    {
+        return value_offset + value_scale * stored;
+    }
+
+    float encode(float value) const
+    {
+        return (value - value_offset) / value_scale;
+    }
 };
 
-Volume load_raw_volume(const std::string &fname,
-                       const vec3i &dims,
-                       const std::string &voxel_type)
+// Call fn(const T *voxels) with the voxels in their native type.
+// Fn is a functor with a templated call operator.
+template <typename Fn>
+void dispatch_voxels(const Volume &volume, Fn &fn)
+{
+    switch (volume.voxel_type) {
+    case VoxelType::UINT8:
+        fn(volume.voxels<uint8_t>());
+        break;
+    case VoxelType::UINT16:
+        fn(volume.voxels<uint16_t>());
+        break;
+    case VoxelType::FLOAT32:
+        fn(volume.voxels<float>());
+        break;
+    case VoxelType::FLOAT64:
+        fn(volume.voxels<double>());
+        break;
+    }
+}
+
+struct VolumeStatsFn {
+    size_t n;
+    float *out;
+    VolumeStats stats;
+
+    template <typename T>
+    void operator()(const T *voxels)
+    {
+        stats = compute_volume_stats(voxels, n, out);
+    }
+};
+
+// Histogram of the stored voxels with the bins of stats.range in values
+struct VolumeHistogramFn {
+    const Volume &volume;
+    VolumeStats &stats;
+
+    template <typename T>
+    void operator()(const T *voxels)
+    {
+        const vec2f stored_range(volume.encode(stats.range.x), volume.encode(stats.range.y));
+        stats.histogram = compute_histogram(voxels, volume.n_voxels(), stored_range);
+    }
+};
+
+// Histogram and brick ranges, the passes that need the range first
+struct VolumeSummaryFn {
+    const Volume &volume;
+    VolumeStats &stats;
+    BrickRanges bricks;
+
+    template <typename T>
+    void operator()(const T *voxels)
+    {
+        VolumeHistogramFn histogram_fn{volume, stats};
+        histogram_fn(voxels);
+        bricks = compute_brick_ranges(voxels, volume.dims, BRICK_RANGE_SIZE);
+    }
+};
+
+struct LoadOptions {
+    // map the file instead of reading it
+    bool use_mmap = false;
+    // convert non-float32 voxels to float32 while scanning them
+    bool to_float32 = false;
+    // reuse stats, histogram and brick ranges from the sidecar cache
+    bool use_cache = true;
+    // concurrent positional reads when the file is read rather than mapped
+    int read_streams = DEFAULT_READ_STREAMS;
+    // posix_fadvise readahead hints for those reads
+    bool readahead = true;
+    // set by another thread to abandon the load, it then throws LoadCancelled
+    const std::atomic<bool> *cancel = nullptr;
+};
+
+struct LoadCancelled : public std::runtime_error {
+    LoadCancelled() : std::runtime_error("Load cancelled") {}
+};
+
+void check_cancelled(const std::atomic<bool> *cancel)
+{
+    if (cancel && *cancel) {
+        throw LoadCancelled();
+    }
+}
+
+void check_cancelled(const LoadOptions &options)
+{
+    check_cancelled(options.cancel);
+}
+
+// Read-only mapping of a whole file, pages are faulted in on demand
+class MappedFile {
+    int fd = -1;
+    uint8_t *ptr = nullptr;
+    size_t length = 0;
+
+public:
+    MappedFile(const std::string &fname)
+    {
+        fd = open(fname.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open volume " + fname);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("Failed to stat volume " + fname);
+        }
+        length = st.st_size;
+        if (length > 0) {
+            void *mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Failed to mmap volume " + fname);
+            }
+            ptr = static_cast<uint8_t *>(mapped);
+        }
+        ResidentBuffers::instance().add("mapped file", length);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        ResidentBuffers::instance().remove("mapped file", length);
+        if (ptr) {
+            munmap(ptr, length);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // Hint the kernel that we will stream through the mapping once
+    void advise_sequential() const
+    {
+        if (ptr) {
+            madvise(ptr, length, MADV_SEQUENTIAL);
+        }
+    }
+
+    const uint8_t *data() const
+    {
+        return ptr;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+};
+
+// Where the voxels of a raw-like file live and how to interpret them.
+// Self-describing formats (npy, nrrd, json sidecar) fill this from their header.
+struct RawVolumeLayout {
+    std::string fname;
+    size_t header_bytes = 0;
+    vec3i dims{0};
+    std::string voxel_type;
+    bool big_endian = false;
+    vec3f spacing{1.f};
+    vec3f origin{0.f};
+};
+
+RawVolumeLayout make_raw_layout(const std::string &fname, const vec3i &dims, const std::string &voxel_type)
+{
+    RawVolumeLayout layout;
+    layout.fname = fname;
+    layout.dims = dims;
+    layout.voxel_type = voxel_type;
+    return layout;
+}
+
+// Reverse the bytes of every voxel in place
+void swap_voxel_bytes(uint8_t *data, size_t n_voxels, size_t voxel_size)
+{
+    if (voxel_size == 1) {
+        return;
+    }
+    const size_t n_chunks = (n_voxels + SCAN_CHUNK_VOXELS - 1) / SCAN_CHUNK_VOXELS;
+    rkcommon::tasking::parallel_for(n_chunks, [&](size_t c) {
+        const size_t end = std::min(n_voxels, (c + 1) * SCAN_CHUNK_VOXELS);
+        for (size_t i = c * SCAN_CHUNK_VOXELS; i < end; ++i) {
+            std::reverse(data + i * voxel_size, data + (i + 1) * voxel_size);
+        }
+    });
+}
+
+// Reads a raw file with parallel streams, swapping and scanning (and
+// optionally converting to float) each range on the thread that read it
+struct ParallelReadFn {
+    const RawVolumeLayout &layout;
+    const LoadOptions &options;
+    uint8_t *dst;
+    bool scan;
+    float *out;
+    std::vector<ScanChunk> chunks;
+
+    template <typename T>
+    void operator()(const T *)
+    {
+        const size_t n_bytes = size_t(layout.dims.x) * layout.dims.y * layout.dims.z * sizeof(T);
+        chunks.assign((n_bytes + READ_RANGE_BYTES - 1) / READ_RANGE_BYTES, ScanChunk());
+        read_file_parallel(layout.fname,
+                           layout.header_bytes,
+                           n_bytes,
+                           dst,
+                           options.read_streams,
+                           options.readahead,
+                           [&](size_t begin, size_t bytes) {
+                               // the reader stops handing out ranges once one throws
+                               check_cancelled(options);
+                               const size_t first = begin / sizeof(T);
+                               const size_t n = bytes / sizeof(T);
+                               if (layout.big_endian) {
+                                   for (size_t i = 0; i < n; ++i) {
+                                       std::reverse(dst + (first + i) * sizeof(T), dst + (first + i + 1) * sizeof(T));
+                                   }
+                               }
+                               const T *in = reinterpret_cast<const T *>(dst) + first;
+                               if (out) {
+                                   chunks[begin / READ_RANGE_BYTES] = scan_voxels<T, true>(in, out + first, n);
+                               } else if (scan) {
+                                   chunks[begin / READ_RANGE_BYTES] = scan_voxels<T, false>(in, nullptr, n);
+                               }
+                           });
+    }
+};
+
+Volume load_raw_volume(const RawVolumeLayout &layout, const LoadOptions &options = LoadOptions())
 {
+    const std::string &fname = layout.fname;
+    const vec3i &dims = layout.dims;
     Volume volume;
     volume.dims = dims;
+    volume.spacing = layout.spacing;
+    volume.origin = layout.origin;
+    volume.voxel_type = parse_voxel_type(layout.voxel_type);
 
-    size_t voxel_size = 0;
-    if (voxel_type == "uint8") {
-        voxel_size = 1;
-    } else if (voxel_type == "uint16") {
-        voxel_size = 2;
-    } else if (voxel_type == "float32") {
-        voxel_size = 4;
-    } else if (voxel_type == "float64") {
-        voxel_size = 8;
-    } else {
-        throw std::runtime_error("Unrecognized voxel type " + voxel_type);
+    const size_t n_bytes = volume.n_voxels() * volume.voxel_size();
+    // Big endian data has to be swapped into a buffer we own, and mapped
+    // voxels behind a header must still be aligned to be used in place
+    const bool map_in_place = !layout.big_endian && layout.header_bytes % volume.voxel_size() == 0;
+    if (options.use_mmap && !map_in_place) {
+        std::cout << "cannot use " << fname << " in place, reading it instead" << std::endl;
     }
 
-    std::ifstream fin(fname.c_str(), std::ios::binary);
-    auto voxel_data = std::make_shared<std::vector<uint8_t>>(volume.n_voxels() * voxel_size, 0);
+    // Reopening a snapshot skips every scan if the sidecar cache matches
+    VolumeCacheKey cache_key;
+    BrickRanges brick_ranges;
+    bool cached = false;
+    if (options.use_cache) {
+        cache_key = make_volume_cache_key(fname, dims, uint32_t(volume.voxel_type));
+        cached = read_volume_cache(fname, cache_key, volume.stats, brick_ranges);
+        if (cached) {
+            std::cout << "using cached stats from " << volume_cache_path(fname) << std::endl;
+        }
+    }
 
-    if (!fin.read(reinterpret_cast<char *>(voxel_data->data()), voxel_data->size())) {
-        throw std::runtime_error("Failed to read volume " + fname);
+    const bool convert = options.to_float32 && volume.voxel_type != VoxelType::FLOAT32;
+    std::shared_ptr<std::vector<float>> converted;
+    if (convert) {
+        converted = allocate_buffer<float>(volume.n_voxels(), "float32 copy");
+    }
+    bool scanned = false;
+    auto start = std::chrono::steady_clock::now();
+    if (options.use_mmap && map_in_place) {
+        auto mapping = std::make_shared<MappedFile>(fname);
+        if (mapping->size() < layout.header_bytes + n_bytes) {
+            throw std::runtime_error("Volume " + fname + " is smaller than dims * dtype");
+        }
+        // Use the mapped pages in place, the mapping lives as long as the voxels do
+        volume.voxel_data = std::shared_ptr<const void>(mapping, mapping->data() + layout.header_bytes);
+        print_throughput("map", n_bytes, seconds_since(start));
+    } else {
+        // Each range is swapped and scanned right after it lands, overlapping the other reads
+        auto voxels = allocate_buffer<uint8_t>(n_bytes, "raw volume");
+        volume.voxel_data = std::shared_ptr<const void>(voxels, voxels->data());
+        ParallelReadFn read_fn{
+            layout, options, voxels->data(), !cached, converted ? converted->data() : nullptr, {}};
+        dispatch_voxels(volume, read_fn);
+        scanned = !cached || convert;
+        if (!cached) {
+            volume.stats = stats_from_scan(read_fn.chunks);
+        }
+        print_throughput(scanned ? "parallel read + stats" : "parallel read", n_bytes, seconds_since(start));
     }
 
-    volume.voxel_data = std::make_shared<std::vector<float>>(volume.n_voxels(), 0.f);
+    // One fused pass for the conversion, range and moments of mapped files
+    if (!scanned && (!cached || convert)) {
+        start = std::chrono::steady_clock::now();
+        VolumeStatsFn stats_fn{volume.n_voxels(), converted ? converted->data() : nullptr, VolumeStats()};
+        dispatch_voxels(volume, stats_fn);
+        print_throughput(converted ? "convert + stats" : "stats", n_bytes, seconds_since(start));
+        if (!cached) {
+            volume.stats = stats_fn.stats;
+        }
+    }
+    if (converted) {
+        volume.voxel_type = VoxelType::FLOAT32;
+        volume.voxel_data = std::shared_ptr<const void>(converted, converted->data());
+    }
 
-    // Temporarily convert non-float data to float
-    // TODO will native support for non-float voxel types
-    if (voxel_type == "uint8") {
-        std::transform(voxel_data->begin(),
-                       voxel_data->end(),
-                       volume.voxel_data->begin(),
-                       [](const uint8_t &x) { return float(x); });
-    } else if (voxel_type == "uint16") {
-        std::transform(reinterpret_cast<uint16_t *>(voxel_data->data()),
-                       reinterpret_cast<uint16_t *>(voxel_data->data()) + volume.n_voxels(),
-                       volume.voxel_data->begin(),
-                       [](const uint16_t &x) { return float(x); });
-    } else if (voxel_type == "float32") {
-        std::transform(reinterpret_cast<float *>(voxel_data->data()),
-                       reinterpret_cast<float *>(voxel_data->data()) + volume.n_voxels(),
-                       volume.voxel_data->begin(),
-                       [](const float &x) { return x; });
-    } else {
-        std::transform(reinterpret_cast<double *>(voxel_data->data()),
-                       reinterpret_cast<double *>(voxel_data->data()) + volume.n_voxels(),
-                       volume.voxel_data->begin(),
-                       [](const double &x) { return float(x); });
-    }
-    
-    // find the range
-    volume.range.x = *std::min_element(volume.voxel_data->begin(), volume.voxel_data->end());
-    volume.range.y = *std::max_element(volume.voxel_data->begin(), volume.voxel_data->end());
-    std::cout << "volume range: " << volume.range << std::endl;
+    check_cancelled(options);
+    if (!cached) {
+        start = std::chrono::steady_clock::now();
+        VolumeSummaryFn summary_fn{volume, volume.stats, BrickRanges()};
+        dispatch_voxels(volume, summary_fn);
+        brick_ranges = summary_fn.bricks;
+        print_throughput("histogram + brick ranges", n_bytes, seconds_since(start));
+        if (options.use_cache) {
+            write_volume_cache(fname, cache_key, volume.stats, brick_ranges);
+        }
+    }
+
+    volume.brick_ranges = std::make_shared<BrickRanges>(brick_ranges);
+    volume.range = volume.stats.range;
+    print_volume_stats(volume.stats);
     // float b = 1.f / (volume.range.y - volume.range.x) * 255.f;
     // std::vector<float> &voxels = *volume.voxel_data;
     // for(int i = 0; i < volume.n_voxels(); ++i){
@@ -94,5 +436,150 @@ Volume load_raw_volume(const std::string &fname,
     return volume;
 }
 
+Volume load_raw_volume(const std::string &fname,
+                       const vec3i &dims,
+                       const std::string &voxel_type,
+                       const LoadOptions &options = LoadOptions())
+{
+    return load_raw_volume(make_raw_layout(fname, dims, voxel_type), options);
+}
+
+// Clamp [lower, upper) to the volume, throws if nothing is left
+void clamp_region(vec3i &lower, vec3i &upper, const vec3i &dims)
+{
+    lower = max(lower, vec3i(0));
+    upper = min(upper, dims);
+    if (lower.x >= upper.x || lower.y >= upper.y || lower.z >= upper.z) {
+        throw std::runtime_error("Empty region of interest");
+    }
+}
+
+// Crop [lower, upper) of a raw-like file without touching the rest of it.
+// Each contiguous run (a row, or a whole slab when the crop spans x and y)
+// is fetched with its own pread, runs are read in parallel.
+Volume load_raw_region(const RawVolumeLayout &layout, vec3i lower, vec3i upper)
+{
+    const vec3i &dims = layout.dims;
+    clamp_region(lower, upper, dims);
+    Volume volume;
+    volume.dims = upper - lower;
+    volume.spacing = layout.spacing;
+    volume.origin = layout.origin + vec3f(lower) * layout.spacing;
+    volume.voxel_type = parse_voxel_type(layout.voxel_type);
+    const size_t voxel_size = volume.voxel_size();
+    const size_t n_bytes = volume.n_voxels() * voxel_size;
+
+    // Rows of the crop merge into longer runs when it covers whole rows or slabs
+    const bool full_rows = lower.x == 0 && upper.x == dims.x;
+    const bool full_slabs = full_rows && lower.y == 0 && upper.y == dims.y;
+    const size_t rows_per_run = full_slabs ? size_t(volume.dims.y) * volume.dims.z
+        : full_rows                         ? size_t(volume.dims.y)
+                                            : 1;
+    const size_t n_rows = size_t(volume.dims.y) * volume.dims.z;
+    const size_t n_runs = n_rows / rows_per_run;
+    const size_t row_bytes = size_t(volume.dims.x) * voxel_size;
+
+    int fd = open(layout.fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open volume " + layout.fname);
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto voxels = allocate_buffer<uint8_t>(n_bytes, "region");
+    volume.voxel_data = std::shared_ptr<const void>(voxels, voxels->data());
+    try {
+        rkcommon::tasking::parallel_for(n_runs, [&](size_t run) {
+            const size_t row = run * rows_per_run;
+            const size_t y = lower.y + row % volume.dims.y;
+            const size_t z = lower.z + row / volume.dims.y;
+            const size_t offset = layout.header_bytes + ((z * dims.y + y) * dims.x + lower.x) * voxel_size;
+            pread_all(fd, voxels->data() + row * row_bytes, rows_per_run * row_bytes, offset);
+        });
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    print_throughput("read region", n_bytes, seconds_since(start));
+    if (layout.big_endian) {
+        swap_voxel_bytes(voxels->data(), volume.n_voxels(), voxel_size);
+    }
+
+    // A crop is small, scan it rather than going through the whole-file cache
+    start = std::chrono::steady_clock::now();
+    VolumeStatsFn stats_fn{volume.n_voxels(), nullptr, VolumeStats()};
+    dispatch_voxels(volume, stats_fn);
+    volume.stats = stats_fn.stats;
+    VolumeSummaryFn summary_fn{volume, volume.stats, BrickRanges()};
+    dispatch_voxels(volume, summary_fn);
+    volume.brick_ranges = std::make_shared<BrickRanges>(summary_fn.bricks);
+    volume.range = volume.stats.range;
+    print_throughput("stats + histogram", n_bytes, seconds_since(start));
+    print_volume_stats(volume.stats);
+    return volume;
+}
+
+// Largest stride that keeps a preview at or below max_voxels
+int preview_stride(const vec3i &dims, size_t max_voxels)
+{
+    const double n = double(dims.x) * dims.y * dims.z;
+    return std::max(1, int(std::ceil(std::cbrt(n / max_voxels))));
+}
+
+struct StridedSampleFn {
+    const uint8_t *raw;
+    vec3i dims;
+    vec3i preview_dims;
+    int stride;
+    void *preview;
+
+    template <typename T>
+    void operator()(const T *)
+    {
+        T *out = static_cast<T *>(preview);
+        rkcommon::tasking::parallel_for(preview_dims.z, [&](int z) {
+            for (int y = 0; y < preview_dims.y; ++y) {
+                // the raw voxels may sit unaligned behind a file header
+                const uint8_t *row = raw + (size_t(z) * stride * dims.y + size_t(y) * stride) * dims.x * sizeof(T);
+                T *dst = out + (size_t(z) * preview_dims.y + y) * preview_dims.x;
+                for (int x = 0; x < preview_dims.x; ++x) {
+                    std::memcpy(dst + x, row + size_t(x) * stride * sizeof(T), sizeof(T));
+                }
+            }
+        });
+    }
+};
+
+// Coarse preview of a raw volume taking every stride-th voxel through a
+// mapping, so only the sampled rows are paged in. The spacing is scaled so
+// the preview covers the same extent as the full volume.
+Volume load_raw_preview(const RawVolumeLayout &layout, int stride)
+{
+    const vec3i &dims = layout.dims;
+    Volume volume;
+    volume.voxel_type = parse_voxel_type(layout.voxel_type);
+    volume.dims = vec3i((dims.x + stride - 1) / stride,
+                        (dims.y + stride - 1) / stride,
+                        (dims.z + stride - 1) / stride);
+    volume.spacing = layout.spacing * float(stride);
+    volume.origin = layout.origin;
 
+    MappedFile mapping(layout.fname);
+    if (mapping.size() < layout.header_bytes + size_t(dims.x) * dims.y * dims.z * volume.voxel_size()) {
+        throw std::runtime_error("Volume " + layout.fname + " is smaller than dims * dtype");
+    }
+    auto voxels = allocate_buffer<uint8_t>(volume.n_voxels() * volume.voxel_size(), "preview");
+    volume.voxel_data = std::shared_ptr<const void>(voxels, voxels->data());
+    StridedSampleFn sample_fn{mapping.data() + layout.header_bytes, dims, volume.dims, stride, voxels->data()};
+    dispatch_voxels(volume, sample_fn);
+    if (layout.big_endian) {
+        swap_voxel_bytes(voxels->data(), volume.n_voxels(), volume.voxel_size());
+    }
 
+    VolumeStatsFn stats_fn{volume.n_voxels(), nullptr, VolumeStats()};
+    dispatch_voxels(volume, stats_fn);
+    volume.stats = stats_fn.stats;
+    VolumeHistogramFn histogram_fn{volume, volume.stats};
+    dispatch_voxels(volume, histogram_fn);
+    volume.range = volume.stats.range;
+    return volume;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "rkcommon/math/vec.h"
+
+#include "dataLoader.h"
+#include "volumeStats.h"
+
+using namespace rkcommon::math;
+
+const int DEFAULT_ISO_LEVELS = 16;
+
+// Bounded set of isosurface levels below a threshold. The levels come from
+// the histogram the loader built on its thread (VolumeStats::histogram), so
+// moving the threshold, changing the level count or swapping in a new
+// volume only walks cumulative counts.
+// Levels are in stored units, ready for the OSPRay isosurface geometry.
+class IsoLevelSet {
+    vec2f range{0.f};
+    std::vector<uint64_t> histogram;
+    std::vector<uint64_t> cumulative;
+
+    float bin_center(size_t bin) const
+    {
+        return range.x + (bin + 0.5f) * (range.y - range.x) / histogram.size();
+    }
+
+public:
+    // Take over the histogram of a volume, its bins span stats.range
+    void adopt(const Volume &volume)
+    {
+        range = vec2f(volume.encode(volume.stats.range.x), volume.encode(volume.stats.range.y));
+        histogram = volume.stats.histogram;
+        cumulative.resize(histogram.size());
+        uint64_t total = 0;
+        for (size_t b = 0; b < histogram.size(); ++b) {
+            total += histogram[b];
+            cumulative[b] = total;
+        }
+    }
+
+    // Up to max_levels distinct levels below threshold (stored units), placed
+    // at evenly spaced quantiles of the voxels under the threshold so they
+    // follow where the data actually is
+    std::vector<float> levels(float threshold, int max_levels) const
+    {
+        std::vector<float> result;
+        if (histogram.empty() || max_levels < 1 || !(threshold > range.x)) {
+            return result;
+        }
+        // last bin that starts below the threshold
+        size_t last_bin = histogram.size() - 1;
+        if (range.y > range.x) {
+            const float bin = std::ceil((threshold - range.x) * histogram.size() / (range.y - range.x));
+            last_bin = std::min(histogram.size(), size_t(bin)) - 1;
+        }
+        const uint64_t below = cumulative[last_bin];
+        if (below == 0) {
+            return result;
+        }
+        for (int k = 1; k <= max_levels; ++k) {
+            const uint64_t target = std::max<uint64_t>(1, below * k / (max_levels + 1));
+            const size_t bin = std::lower_bound(cumulative.begin(), cumulative.begin() + last_bin + 1, target)
+                - cumulative.begin();
+            const float level = std::min(bin_center(bin), threshold);
+            if (result.empty() || level != result.back()) {
+                result.push_back(level);
+            }
+        }
+        return result;
+    }
+};
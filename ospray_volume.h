@@ -1,45 +1,263 @@
 #pragma once
 
 #include <vector>
+#include <memory>
+#include <limits>
+#include <algorithm>
 
 #include "ospray/ospray_cpp.h"
 #include "ospray/ospray_util.h"
 #include "rkcommon/math/vec.h"
 #include "rkcommon/math/box.h"
+#include "rkcommon/math/AffineSpace.h"
+#include "rkcommon/tasking/parallel_for.h"
 
 #include "dataLoader.h"
+#include "particles.h"
+#include "brickIntervals.h"
 
 using namespace rkcommon::math;
 
-ospray::cpp::Volume createStructuredVolume(const Volume volume)
+// Wraps the voxels without copying them, OSPRay reads the loader's buffer
+// directly. The caller keeps the Volume (and so the buffer) alive for as
+// long as the OSPRay volume uses it.
+ospray::cpp::SharedData makeVoxelData(const Volume &volume)
 {
-  ospray::cpp::Volume osp_volume("structuredRegular");
+  switch (volume.voxel_type) {
+  case VoxelType::UINT8:
+    return ospray::cpp::SharedData(volume.voxels<uint8_t>(), volume.dims);
+  case VoxelType::UINT16:
+    return ospray::cpp::SharedData(volume.voxels<uint16_t>(), volume.dims);
+  case VoxelType::FLOAT64:
+    return ospray::cpp::SharedData(volume.voxels<double>(), volume.dims);
+  default:
+    return ospray::cpp::SharedData(volume.voxels<float>(), volume.dims);
+  }
+}
 
-  auto voxels = *(volume.voxel_data);
+// Point an existing structuredRegular volume at new voxels, e.g. when a
+// preview is replaced by the full resolution data
+void updateStructuredVolume(ospray::cpp::Volume &osp_volume, const Volume &volume)
+{
+  const vec3f spacing = 2.f * volume.spacing;
 // vec3f(-volume.dims.x/ 2.f, -volume.dims.y/2.f, -volume.dims.z/2.f)
-  osp_volume.setParam("gridOrigin", vec3f(-volume.dims.x/ 2.f, -volume.dims.y/2.f, -volume.dims.z/2.f));
-  osp_volume.setParam("gridSpacing", vec3f(2.f));
-  osp_volume.setParam("data", ospray::cpp::CopiedData(voxels.data(), volume.dims));
+  osp_volume.setParam("gridOrigin", vec3f(-volume.dims.x/ 2.f, -volume.dims.y/2.f, -volume.dims.z/2.f) * volume.spacing);
+  osp_volume.setParam("gridSpacing", spacing);
+  // structuredRegular takes the native voxel type, no conversion to float
+  osp_volume.setParam("data", makeVoxelData(volume));
   osp_volume.commit();
-  return osp_volume;
 }
- 
 
-std::vector<float> getAllIsoValues(const Volume volume, float iso_value)
+// OSPRay samples the stored voxels, so value ranges given to it are encoded too
+vec2f storedValueRange(const Volume &volume, const vec2f &range)
 {
-  std::vector<float> iso_values;
+  return vec2f(volume.encode(range.x), volume.encode(range.y));
+}
+
+ospray::cpp::Volume createStructuredVolume(const Volume &volume)
+{
+  ospray::cpp::Volume osp_volume("structuredRegular");
+  updateStructuredVolume(osp_volume, volume);
+  return osp_volume;
+}
+
+// Leaves of the sparse volume, the VDB leaf level
+const int VDB_LEAF_SIZE = 8;
+const uint32_t VDB_LEAF_LEVEL = 3;
+
+// A vdb volume holding only the 8^3 leaves of a dense volume that can show
+// values below a threshold. Rays skip the space between leaves. Full leaves
+// are not copied: OSPRay reads each one through a strided view of the dense
+// buffer in its stored type, as makeVoxelData does for the whole volume. Only
+// the partial leaves on the upper faces are padded copies.
+struct SparseVolume {
+  ospray::cpp::Volume volume;
+  // the dense voxels the leaves view, and the padded partial leaves
+  std::shared_ptr<const void> voxel_data;
+  std::shared_ptr<const void> edge_leaves;
+  // min/max of every leaf and its one-voxel apron, reused when only the
+  // threshold changes
+  std::shared_ptr<const BrickRanges> leaf_ranges;
+  // values below this are covered
+  float threshold = 0.f;
+  size_t n_leaves = 0;
+  size_t total_leaves = 0;
+  // voxel bytes the leaves cover, bytes copied for partial leaves and bytes
+  // of the dense volume
+  size_t leaf_bytes = 0;
+  size_t copied_bytes = 0;
+  size_t dense_bytes = 0;
+};
 
-  auto voxels = *(volume.voxel_data);
-  // std::cout << voxels.size() << std::endl;
+struct SparseLeavesFn {
+  const Volume &volume;
+  const std::vector<size_t> &leaves;
+  const BrickRanges &leaf_grid;
+  std::vector<ospray::cpp::SharedData> data;
+  std::shared_ptr<const void> edge_leaves;
+  size_t n_edge_leaves;
+
+  template <typename T>
+  void operator()(const T *voxels)
+  {
+    const int n = VDB_LEAF_SIZE;
+    const vec3i dims = volume.dims;
+    const size_t leaf_voxels = size_t(n) * n * n;
+    std::vector<size_t> edge(leaves.size(), size_t(-1));
+    n_edge_leaves = 0;
+    for (size_t l = 0; l < leaves.size(); ++l) {
+      vec3i lower, upper;
+      brick_bounds(leaf_grid, dims, leaves[l], lower, upper);
+      if (upper - lower != vec3i(n)) {
+        edge[l] = n_edge_leaves++;
+      }
+    }
+    auto padded = allocate_buffer<T>(n_edge_leaves * leaf_voxels, "sparse edge leaves");
+    edge_leaves = std::shared_ptr<const void>(padded, padded->data());
 
-  for( int i = 0; i < voxels.size(); i++){
-    if(voxels[i] < iso_value){
-      iso_values.push_back(voxels[i]);
+    // zyx order, z fastest: the first axis of each view steps through z
+    const int64_t voxel_bytes = sizeof(T);
+    const vec3l strides(voxel_bytes * dims.x * dims.y, voxel_bytes * dims.x, voxel_bytes);
+    data.clear();
+    data.reserve(leaves.size());
+    for (size_t l = 0; l < leaves.size(); ++l) {
+      vec3i lower, upper;
+      brick_bounds(leaf_grid, dims, leaves[l], lower, upper);
+      if (edge[l] == size_t(-1)) {
+        const T *first = voxels + (size_t(lower.z) * dims.y + lower.y) * dims.x + lower.x;
+        data.push_back(ospray::cpp::SharedData(first, vec3ul(n, n, n), strides));
+        continue;
+      }
+      // partial leaves repeat the edge voxels
+      T *leaf = padded->data() + edge[l] * leaf_voxels;
+      for (int x = 0; x < n; ++x) {
+        const size_t vx = std::min(lower.x + x, dims.x - 1);
+        for (int y = 0; y < n; ++y) {
+          const size_t vy = std::min(lower.y + y, dims.y - 1);
+          for (int z = 0; z < n; ++z) {
+            const size_t vz = std::min(lower.z + z, dims.z - 1);
+            leaf[(x * n + y) * n + z] = voxels[(vz * dims.y + vy) * dims.x + vx];
+          }
+        }
+      }
+      data.push_back(ospray::cpp::SharedData(static_cast<const T *>(leaf), vec3ul(n, n, n)));
     }
   }
-  // std::cout << iso_values.size() << std::endl;
-  
-  return iso_values;
+};
+
+struct LeafRangesFn {
+  const Volume &volume;
+  BrickRanges ranges;
+
+  template <typename T>
+  void operator()(const T *voxels)
+  {
+    ranges = compute_brick_ranges(voxels, volume.dims, VDB_LEAF_SIZE, 1);
+  }
+};
+
+// Sparse view of a volume with the leaves whose cells can hold values below
+// threshold. A cell between two leaves samples both, so a leaf is kept when
+// it or its one-voxel apron goes below the threshold: that covers exactly the
+// neighbours the surfaces cross into, not every leaf around a kept one.
+// Samples stay in stored units, so the transfer function and iso values of
+// the dense volume apply unchanged. leaf_ranges may come from an earlier
+// sparse view of the volume.
+SparseVolume createSparseVolume(const Volume &volume,
+                                float threshold,
+                                std::shared_ptr<const BrickRanges> leaf_ranges = nullptr)
+{
+  auto start = std::chrono::steady_clock::now();
+  if (!leaf_ranges) {
+    LeafRangesFn ranges_fn{volume, BrickRanges()};
+    dispatch_voxels(volume, ranges_fn);
+    leaf_ranges = std::make_shared<BrickRanges>(ranges_fn.ranges);
+  }
+  const vec2f stored = storedValueRange(volume, vec2f(-std::numeric_limits<float>::infinity(), threshold));
+  std::vector<size_t> leaves = BrickIntervals(leaf_ranges).overlapping(stored.x, stored.y);
+  std::sort(leaves.begin(), leaves.end());
+
+  SparseLeavesFn leaves_fn{volume, leaves, *leaf_ranges, {}, nullptr, 0};
+  dispatch_voxels(volume, leaves_fn);
+
+  SparseVolume sparse;
+  sparse.voxel_data = volume.voxel_data;
+  sparse.edge_leaves = leaves_fn.edge_leaves;
+  sparse.leaf_ranges = leaf_ranges;
+  sparse.threshold = threshold;
+  sparse.n_leaves = leaves.size();
+  sparse.total_leaves = leaf_ranges->ranges.size();
+  const size_t leaf_bytes = size_t(VDB_LEAF_SIZE) * VDB_LEAF_SIZE * VDB_LEAF_SIZE * volume.voxel_size();
+  sparse.leaf_bytes = leaves.size() * leaf_bytes;
+  sparse.copied_bytes = leaves_fn.n_edge_leaves * leaf_bytes;
+  sparse.dense_bytes = volume.n_voxels() * volume.voxel_size();
+
+  std::vector<uint32_t> levels(leaves.size(), VDB_LEAF_LEVEL);
+  std::vector<uint32_t> formats(leaves.size(), OSP_VOLUME_FORMAT_DENSE_ZYX);
+  std::vector<vec3i> origins(leaves.size());
+  for (size_t l = 0; l < leaves.size(); ++l) {
+    vec3i upper;
+    brick_bounds(*leaf_ranges, volume.dims, leaves[l], origins[l], upper);
+  }
+
+  // same placement as the structuredRegular volume
+  const vec3f gridOrigin = vec3f(-volume.dims.x/ 2.f, -volume.dims.y/2.f, -volume.dims.z/2.f) * volume.spacing;
+  const vec3f gridSpacing = 2.f * volume.spacing;
+  sparse.volume = ospray::cpp::Volume("vdb");
+  sparse.volume.setParam("node.level", ospray::cpp::CopiedData(levels));
+  sparse.volume.setParam("node.origin", ospray::cpp::CopiedData(origins));
+  sparse.volume.setParam("node.format", ospray::cpp::CopiedData(formats));
+  sparse.volume.setParam("node.data", ospray::cpp::CopiedData(leaves_fn.data));
+  sparse.volume.setParam("indexToObject", affine3f::translate(gridOrigin) * affine3f::scale(gridSpacing));
+  sparse.volume.commit();
+
+  std::cout << "sparse volume: " << sparse.n_leaves << " of " << sparse.total_leaves << " leaves below "
+            << threshold << ", " << sparse.leaf_bytes / 1e6 << " of " << sparse.dense_bytes / 1e6
+            << " MB dense, " << sparse.copied_bytes / 1e6 << " MB copied, in " << seconds_since(start) << " s"
+            << std::endl;
+  return sparse;
+}
+
+// Spheres at n cell coordinates of a grid (voxel i at the center of cell i),
+// placed in the world space of the grid's structuredRegular volume. Every
+// stride-th point is kept so at most max_spheres are drawn, with a radius in
+// grid cells.
+template <typename CellCoords>
+ospray::cpp::Geometry createGridSpheres(size_t n, const CellCoords &cell_coords, const Volume &grid, size_t max_spheres, float radius_cells)
+{
+  const vec3f gridOrigin = vec3f(-grid.dims.x/ 2.f, -grid.dims.y/2.f, -grid.dims.z/2.f) * grid.spacing;
+  const vec3f gridSpacing = 2.f * grid.spacing;
+  const size_t stride = std::max<size_t>(1, (n + max_spheres - 1) / max_spheres);
+
+  std::vector<vec3f> centers((n + stride - 1) / stride);
+  rkcommon::tasking::parallel_for(centers.size(), [&](size_t i) {
+    centers[i] = gridOrigin + (cell_coords(i * stride) - 0.5f) * gridSpacing;
+  });
+
+  ospray::cpp::Geometry spheres("sphere");
+  spheres.setParam("sphere.position", ospray::cpp::CopiedData(centers));
+  spheres.setParam("radius", radius_cells * reduce_min(gridSpacing));
+  spheres.commit();
+  return spheres;
+}
+
+// Spheres at the particles a grid was deposited from
+ospray::cpp::Geometry createParticleSpheres(const Particles &particles, const Volume &grid, size_t max_spheres, float radius_cells = 0.5f)
+{
+  const vec3f to_cell = vec3f(grid.dims) / particles.bounds.size();
+  return createGridSpheres(particles.size(), [&](size_t i) {
+    return ((*particles.positions)[i] - particles.bounds.lower) * to_cell;
+  }, grid, max_spheres, radius_cells);
+}
+
+// One sphere per voxel index of grid, e.g. the voxels of a void
+ospray::cpp::Geometry createVoxelSpheres(const uint64_t *begin, const uint64_t *end, const Volume &grid, size_t max_spheres, float radius_cells = 0.5f)
+{
+  const size_t plane = size_t(grid.dims.x) * grid.dims.y;
+  return createGridSpheres(size_t(end - begin), [&](size_t i) {
+    const uint64_t v = begin[i];
+    return vec3f(float(v % grid.dims.x), float((v / grid.dims.x) % grid.dims.y), float(v / plane)) + 0.5f;
+  }, grid, max_spheres, radius_cells);
 }
 
 // void update_transfer_fcn(ospray::cpp::TransferFunction &tfcn, const std::vector<uint8_t> &colormap, rkcommon::math::vec2f valueRange) {
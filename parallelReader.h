@@ -0,0 +1,100 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Positional read of exactly n bytes, safe to call from several threads on one fd
+void pread_all(int fd, void *dst, size_t n, size_t offset)
+{
+    uint8_t *out = static_cast<uint8_t *>(dst);
+    size_t done = 0;
+    while (done < n) {
+        const ssize_t got = pread(fd, out + done, n - done, offset + done);
+        if (got <= 0) {
+            throw std::runtime_error("Failed to read " + std::to_string(n) + " bytes at " + std::to_string(offset));
+        }
+        done += got;
+    }
+}
+
+// Size of one read request. A multiple of every voxel size and of the page
+// size, and large enough to keep a parallel filesystem streaming.
+const size_t READ_RANGE_BYTES = size_t(8) << 20;
+// Concurrent read streams, parallel filesystems want several in flight
+const int DEFAULT_READ_STREAMS = 8;
+
+// Reads n_bytes starting at offset into dst with several threads, each one
+// taking the next READ_RANGE_BYTES range and issuing a pread for it. Ranges
+// are aligned relative to offset so they always hold whole voxels.
+// on_range(begin, bytes) runs on the reading thread as soon as a range has
+// landed, so conversion of one range overlaps the reads of the others.
+void read_file_parallel(const std::string &fname,
+                        size_t offset,
+                        size_t n_bytes,
+                        uint8_t *dst,
+                        int streams,
+                        bool readahead,
+                        const std::function<void(size_t, size_t)> &on_range)
+{
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open volume " + fname);
+    }
+    if (readahead) {
+        posix_fadvise(fd, offset, n_bytes, POSIX_FADV_SEQUENTIAL);
+    }
+
+    const size_t n_ranges = (n_bytes + READ_RANGE_BYTES - 1) / READ_RANGE_BYTES;
+    std::atomic<size_t> next_range(0);
+    std::mutex error_lock;
+    std::exception_ptr error;
+    auto read_ranges = [&]() {
+        size_t r;
+        while ((r = next_range++) < n_ranges) {
+            const size_t begin = r * READ_RANGE_BYTES;
+            const size_t bytes = std::min(READ_RANGE_BYTES, n_bytes - begin);
+            try {
+                if (readahead && r + 1 < n_ranges) {
+                    // let the kernel start on the range this thread is likely to take next
+                    const size_t ahead = begin + size_t(streams) * READ_RANGE_BYTES;
+                    if (ahead < n_bytes) {
+                        posix_fadvise(fd, offset + ahead, std::min(READ_RANGE_BYTES, n_bytes - ahead),
+                                      POSIX_FADV_WILLNEED);
+                    }
+                }
+                pread_all(fd, dst + begin, bytes, offset + begin);
+                if (on_range) {
+                    on_range(begin, bytes);
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(error_lock);
+                error = std::current_exception();
+                next_range = n_ranges;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    const size_t n_workers = std::min(n_ranges, size_t(std::max(1, streams)));
+    for (size_t i = 1; i < n_workers; ++i) {
+        workers.emplace_back(read_ranges);
+    }
+    read_ranges();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    close(fd);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+#include "rkcommon/math/vec.h"
+#include "rkcommon/math/box.h"
+#include "rkcommon/tasking/parallel_for.h"
+
+#include "dataLoader.h"
+#include "parallelReader.h"
+#include "residentBuffers.h"
+
+using namespace rkcommon::math;
+
+// Flat binary particle snapshot: float32 records of x, y, z and, if
+// has_mass, the particle mass. Without masses every particle weighs 1.
+struct ParticleLayout {
+    std::string fname;
+    size_t header_bytes = 0;
+    bool has_mass = false;
+    // periodic box [0, box_size)^3, 0 takes the bounds of the particles and no wrapping
+    float box_size = 0.f;
+};
+
+struct Particles {
+    std::shared_ptr<std::vector<vec3f>> positions;
+    // empty when all masses are 1
+    std::shared_ptr<std::vector<float>> masses;
+    box3f bounds;
+    bool periodic = false;
+
+    size_t size() const
+    {
+        return positions ? positions->size() : 0;
+    }
+};
+
+// Mass assignment to the grid, the kernel covers 1, 2 or 3 cells per axis
+enum class DepositScheme { NGP, CIC, TSC };
+
+DepositScheme parse_deposit_scheme(const std::string &scheme)
+{
+    if (scheme == "ngp") {
+        return DepositScheme::NGP;
+    } else if (scheme == "cic") {
+        return DepositScheme::CIC;
+    } else if (scheme == "tsc") {
+        return DepositScheme::TSC;
+    }
+    throw std::runtime_error("Unknown deposit scheme " + scheme + ", expected ngp, cic or tsc");
+}
+
+// Drops the records with a NaN or Inf coordinate or mass, which would
+// poison the bounds and the cell indices, and wraps the others into a
+// periodic box so every cell coordinate fits an int. Returns how many were
+// dropped, the rest keep their order.
+size_t sanitize_particles(Particles &particles, float box_size)
+{
+    std::vector<vec3f> &positions = *particles.positions;
+    const size_t n = positions.size();
+    auto finite = [&](size_t i) {
+        const vec3f &p = positions[i];
+        return std::isfinite(p.x) && std::isfinite(p.y) && std::isfinite(p.z)
+            && (!particles.masses || std::isfinite((*particles.masses)[i]));
+    };
+    const size_t n_chunks = (n + SCAN_CHUNK_VOXELS - 1) / SCAN_CHUNK_VOXELS;
+    std::vector<size_t> chunk_dropped(n_chunks, 0);
+    rkcommon::tasking::parallel_for(n_chunks, [&](size_t c) {
+        const size_t end = std::min(n, (c + 1) * SCAN_CHUNK_VOXELS);
+        for (size_t i = c * SCAN_CHUNK_VOXELS; i < end; ++i) {
+            if (!finite(i)) {
+                ++chunk_dropped[c];
+            } else if (box_size > 0.f) {
+                vec3f &p = positions[i];
+                p.x -= box_size * std::floor(p.x / box_size);
+                p.y -= box_size * std::floor(p.y / box_size);
+                p.z -= box_size * std::floor(p.z / box_size);
+            }
+        }
+    });
+    size_t dropped = 0;
+    for (size_t count : chunk_dropped) {
+        dropped += count;
+    }
+    if (dropped == 0) {
+        return 0;
+    }
+    // rare, a serial pass compacts in place
+    size_t kept = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (finite(i)) {
+            positions[kept] = positions[i];
+            if (particles.masses) {
+                (*particles.masses)[kept] = (*particles.masses)[i];
+            }
+            ++kept;
+        }
+    }
+    positions.resize(kept);
+    if (particles.masses) {
+        particles.masses->resize(kept);
+    }
+    return dropped;
+}
+
+Particles load_particles(const ParticleLayout &layout, int read_streams = DEFAULT_READ_STREAMS)
+{
+    struct stat st;
+    if (stat(layout.fname.c_str(), &st) != 0) {
+        throw std::runtime_error("Failed to open particles " + layout.fname);
+    }
+    const size_t record_floats = layout.has_mass ? 4 : 3;
+    const size_t record_bytes = record_floats * sizeof(float);
+    if (size_t(st.st_size) < layout.header_bytes || (st.st_size - layout.header_bytes) % record_bytes != 0) {
+        throw std::runtime_error("Size of " + layout.fname + " is not a whole number of particle records");
+    }
+    const size_t n = (st.st_size - layout.header_bytes) / record_bytes;
+
+    auto start = std::chrono::steady_clock::now();
+    Particles particles;
+    particles.positions = allocate_buffer<vec3f>(n, "particles");
+    if (layout.has_mass) {
+        // records are read into a scratch buffer and split, positions alone are read in place
+        std::vector<float> records(n * record_floats);
+        read_file_parallel(layout.fname, layout.header_bytes, n * record_bytes,
+                           reinterpret_cast<uint8_t *>(records.data()), read_streams, true, nullptr);
+        particles.masses = allocate_buffer<float>(n, "particles");
+        rkcommon::tasking::parallel_for((n + SCAN_CHUNK_VOXELS - 1) / SCAN_CHUNK_VOXELS, [&](size_t c) {
+            const size_t end = std::min(n, (c + 1) * SCAN_CHUNK_VOXELS);
+            for (size_t i = c * SCAN_CHUNK_VOXELS; i < end; ++i) {
+                const float *r = &records[i * 4];
+                (*particles.positions)[i] = vec3f(r[0], r[1], r[2]);
+                (*particles.masses)[i] = r[3];
+            }
+        });
+    } else {
+        read_file_parallel(layout.fname, layout.header_bytes, n * record_bytes,
+                           reinterpret_cast<uint8_t *>(particles.positions->data()), read_streams, true, nullptr);
+    }
+    print_throughput("read particles", n * record_bytes, seconds_since(start));
+    const size_t dropped = sanitize_particles(particles, layout.box_size);
+    if (dropped > 0) {
+        std::cout << "dropped " << dropped << " particles with NaN or Inf values" << std::endl;
+    }
+    const size_t n_kept = particles.size();
+
+    if (layout.box_size > 0.f) {
+        particles.bounds = box3f(vec3f(0.f), vec3f(layout.box_size));
+        particles.periodic = true;
+    } else {
+        const size_t n_chunks = (n_kept + SCAN_CHUNK_VOXELS - 1) / SCAN_CHUNK_VOXELS;
+        std::vector<box3f> chunk_bounds(n_chunks);
+        rkcommon::tasking::parallel_for(n_chunks, [&](size_t c) {
+            const size_t end = std::min(n_kept, (c + 1) * SCAN_CHUNK_VOXELS);
+            box3f bounds((*particles.positions)[c * SCAN_CHUNK_VOXELS], (*particles.positions)[c * SCAN_CHUNK_VOXELS]);
+            for (size_t i = c * SCAN_CHUNK_VOXELS; i < end; ++i) {
+                bounds.lower = min(bounds.lower, (*particles.positions)[i]);
+                bounds.upper = max(bounds.upper, (*particles.positions)[i]);
+            }
+            chunk_bounds[c] = bounds;
+        });
+        particles.bounds = chunk_bounds.empty() ? box3f(vec3f(0.f), vec3f(1.f)) : chunk_bounds[0];
+        for (const box3f &bounds : chunk_bounds) {
+            particles.bounds.lower = min(particles.bounds.lower, bounds.lower);
+            particles.bounds.upper = max(particles.bounds.upper, bounds.upper);
+        }
+        // keep the particles on the upper faces inside the last cell
+        particles.bounds.upper = particles.bounds.upper + 1e-5f * max(particles.bounds.size(), vec3f(1e-5f));
+    }
+    std::cout << n_kept << " particles in " << particles.bounds.lower << " to " << particles.bounds.upper << std::endl;
+    return particles;
+}
+
+// Cells and weights of one axis of the kernel around cell coordinate u
+// (cell centers at i + 0.5). Returns the number of cells touched.
+int deposit_weights(DepositScheme scheme, float u, int &first, float *w)
+{
+    switch (scheme) {
+    case DepositScheme::NGP:
+        first = int(std::floor(u));
+        w[0] = 1.f;
+        return 1;
+    case DepositScheme::CIC: {
+        const float d = u - 0.5f;
+        first = int(std::floor(d));
+        const float f = d - first;
+        w[0] = 1.f - f;
+        w[1] = f;
+        return 2;
+    }
+    default: {
+        const int i = int(std::floor(u));
+        const float d = u - (i + 0.5f);
+        first = i - 1;
+        w[0] = 0.5f * (0.5f - d) * (0.5f - d);
+        w[1] = 0.75f - d * d;
+        w[2] = 0.5f * (0.5f + d) * (0.5f + d);
+        return 3;
+    }
+    }
+}
+
+// Deposits the mass of every particle onto a dims grid over the particle
+// bounds. Kernels wrap around periodic boxes and are clamped to the edge
+// cells otherwise, so all mass lands on the grid. The result is float32 in
+// units of the mean density. Particles are binned into z slabs at least 4 cells thick, so
+// a kernel never reaches past the neighbouring slab. Even slabs then odd
+// slabs are deposited in parallel without atomics or per-thread grids.
+Volume deposit_particles(const Particles &particles, const vec3i &dims, DepositScheme scheme)
+{
+    auto start = std::chrono::steady_clock::now();
+    const size_t n = particles.size();
+    const vec3f cell = particles.bounds.size() / vec3f(dims);
+    const vec3f to_cell = 1.f / cell;
+    auto cell_coords = [&](size_t i) { return ((*particles.positions)[i] - particles.bounds.lower) * to_cell; };
+
+    // an even number of slabs, so the first and last slab differ in parity when wrapping
+    const int SLAB_CELLS = 4;
+    int n_slabs = std::max(1, dims.z / SLAB_CELLS);
+    if (n_slabs > 1 && n_slabs % 2 == 1) {
+        --n_slabs;
+    }
+    auto to_grid = [&](int i, int n) {
+        return particles.periodic ? ((i % n) + n) % n : std::min(std::max(i, 0), n - 1);
+    };
+    auto slab_of = [&](size_t i) {
+        const int z = to_grid(int(std::floor(cell_coords(i).z)), dims.z);
+        return std::min(n_slabs - 1, int(size_t(z) * n_slabs / dims.z));
+    };
+
+    // counting sort of the particle indices by slab
+    const size_t n_chunks = (n + SCAN_CHUNK_VOXELS - 1) / SCAN_CHUNK_VOXELS;
+    std::vector<size_t> offsets(n_chunks * n_slabs, 0);
+    rkcommon::tasking::parallel_for(n_chunks, [&](size_t c) {
+        const size_t end = std::min(n, (c + 1) * SCAN_CHUNK_VOXELS);
+        for (size_t i = c * SCAN_CHUNK_VOXELS; i < end; ++i) {
+            ++offsets[c * n_slabs + slab_of(i)];
+        }
+    });
+    std::vector<size_t> slab_begin(n_slabs + 1, 0);
+    size_t offset = 0;
+    for (int s = 0; s < n_slabs; ++s) {
+        slab_begin[s] = offset;
+        for (size_t c = 0; c < n_chunks; ++c) {
+            const size_t count = offsets[c * n_slabs + s];
+            offsets[c * n_slabs + s] = offset;
+            offset += count;
+        }
+    }
+    slab_begin[n_slabs] = offset;
+    std::vector<size_t> by_slab(n);
+    rkcommon::tasking::parallel_for(n_chunks, [&](size_t c) {
+        const size_t end = std::min(n, (c + 1) * SCAN_CHUNK_VOXELS);
+        for (size_t i = c * SCAN_CHUNK_VOXELS; i < end; ++i) {
+            by_slab[offsets[c * n_slabs + slab_of(i)]++] = i;
+        }
+    });
+
+    Volume volume;
+    volume.dims = dims;
+    volume.voxel_type = VoxelType::FLOAT32;
+    auto grid = allocate_buffer<float>(volume.n_voxels(), "deposited");
+    volume.voxel_data = std::shared_ptr<const void>(grid, grid->data());
+    float *density = grid->data();
+
+    auto deposit_slab = [&](size_t s) {
+        float wx[3], wy[3], wz[3];
+        for (size_t k = slab_begin[s]; k < slab_begin[s + 1]; ++k) {
+            const size_t i = by_slab[k];
+            const vec3f u = cell_coords(i);
+            const float mass = particles.masses ? (*particles.masses)[i] : 1.f;
+            vec3i first;
+            const int nx = deposit_weights(scheme, u.x, first.x, wx);
+            const int ny = deposit_weights(scheme, u.y, first.y, wy);
+            const int nz = deposit_weights(scheme, u.z, first.z, wz);
+            for (int c = 0; c < nz; ++c) {
+                const int z = to_grid(first.z + c, dims.z);
+                for (int b = 0; b < ny; ++b) {
+                    const int y = to_grid(first.y + b, dims.y);
+                    float *row = density + (size_t(z) * dims.y + y) * dims.x;
+                    for (int a = 0; a < nx; ++a) {
+                        row[to_grid(first.x + a, dims.x)] += mass * wx[a] * wy[b] * wz[c];
+                    }
+                }
+            }
+        }
+    };
+    if (n_slabs == 1) {
+        deposit_slab(0);
+    } else {
+        for (int parity = 0; parity < 2; ++parity) {
+            rkcommon::tasking::parallel_for(size_t(n_slabs / 2), [&](size_t s) { deposit_slab(2 * s + parity); });
+        }
+    }
+
+    // normalize to the mean density
+    VolumeStatsFn sum_fn{volume.n_voxels(), nullptr, VolumeStats()};
+    dispatch_voxels(volume, sum_fn);
+    const float inv_mean = sum_fn.stats.mean > 0.0 ? float(1.0 / sum_fn.stats.mean) : 1.f;
+    rkcommon::tasking::parallel_for((volume.n_voxels() + SCAN_CHUNK_VOXELS - 1) / SCAN_CHUNK_VOXELS, [&](size_t c) {
+        const size_t end = std::min(volume.n_voxels(), (c + 1) * SCAN_CHUNK_VOXELS);
+        for (size_t i = c * SCAN_CHUNK_VOXELS; i < end; ++i) {
+            density[i] *= inv_mean;
+        }
+    });
+    print_throughput("deposit particles", n * sizeof(vec3f), seconds_since(start));
+
+    VolumeStatsFn stats_fn{volume.n_voxels(), nullptr, VolumeStats()};
+    dispatch_voxels(volume, stats_fn);
+    volume.stats = stats_fn.stats;
+    VolumeSummaryFn summary_fn{volume, volume.stats, BrickRanges()};
+    dispatch_voxels(volume, summary_fn);
+    volume.brick_ranges = std::make_shared<BrickRanges>(summary_fn.bricks);
+    volume.range = volume.stats.range;
+    print_volume_stats(volume.stats);
+    return volume;
+}
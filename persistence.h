@@ -0,0 +1,623 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <limits>
+#include <algorithm>
+
+#include "rkcommon/math/vec.h"
+#include "rkcommon/tasking/parallel_for.h"
+
+#include "dataLoader.h"
+#include "valueIndex.h"
+#include "residentBuffers.h"
+
+using namespace rkcommon::math;
+
+// 0-dimensional persistence of the sublevel sets of a volume, 6-connected.
+// A component is born at a local minimum and dies when it merges into an
+// older one (elder rule). Voxels are ordered by value with ties broken by
+// index, NaN voxels never enter the filtration.
+
+// Marks a voxel that is not part of a pair or face, e.g. the death of the
+// components that never merge
+const uint64_t NO_VOXEL = std::numeric_limits<uint64_t>::max();
+// Parent of the branches that never merge, label of NaN voxels
+const uint32_t NO_BRANCH = std::numeric_limits<uint32_t>::max();
+
+struct PersistencePair {
+    float birth;
+    float death;
+    uint64_t birth_voxel;
+    uint64_t death_voxel;
+    // branch of the merge tree, links the pair to its voxels
+    uint32_t branch;
+
+    float persistence() const
+    {
+        return death - birth;
+    }
+};
+
+// Position of a voxel in the filtration
+struct FiltrationKey {
+    uint32_t value;
+    uint64_t voxel;
+
+    bool operator<(const FiltrationKey &other) const
+    {
+        return value < other.value || (value == other.value && voxel < other.voxel);
+    }
+};
+
+// Merge of the components born at a and b when voxel at enters. Once
+// resolved a is the elder and b the younger, which dies there.
+struct MergeEdge {
+    FiltrationKey at;
+    uint64_t a;
+    uint64_t b;
+};
+
+// What a z slab leaves for the global merge. Merges whose younger component
+// never touched a slab face are final right away, the rest are deferred:
+// they may already be connected through another slab.
+struct SlabPersistence {
+    std::vector<MergeEdge> merges;
+    std::vector<MergeEdge> deferred;
+    // minima of the components alive at the end of the slab sweep
+    std::vector<uint64_t> survivors;
+    // per voxel of the lower/upper face, the minimum of its component when it entered
+    std::vector<uint64_t> lower_face;
+    std::vector<uint64_t> upper_face;
+    // per voxel, the slab-local root of its component when it entered (for labels only)
+    std::vector<uint32_t> entry_root;
+};
+
+// Union-find root with path halving
+template <typename I>
+I find_root(std::vector<I> &parent, I v)
+{
+    while (parent[v] != v) {
+        parent[v] = parent[parent[v]];
+        v = parent[v];
+    }
+    return v;
+}
+
+struct PersistenceFn {
+    const Volume &volume;
+    int n_slabs;
+    bool with_labels;
+    // a raised flag leaves the remaining slabs unswept
+    const std::atomic<bool> *cancel;
+    std::vector<SlabPersistence> slabs;
+
+    template <typename T>
+    float value(const T *voxels, uint64_t i) const
+    {
+        return volume.decode(float(voxels[i]));
+    }
+
+    // Sweep of one slab in filtration order with union-find. Roots are always
+    // the minimum of their component, so a root is also its birth voxel.
+    template <typename T>
+    void sweep_slab(const T *voxels, int s)
+    {
+        const vec3i dims = volume.dims;
+        const int z0 = int(size_t(dims.z) * s / n_slabs);
+        const int z1 = int(size_t(dims.z) * (s + 1) / n_slabs);
+        const size_t plane = size_t(dims.x) * dims.y;
+        const uint64_t base = z0 * plane;
+        const uint32_t n = uint32_t((z1 - z0) * plane);
+        const uint32_t UNSEEN = std::numeric_limits<uint32_t>::max();
+        SlabPersistence &slab = slabs[s];
+        if (cancel && *cancel) {
+            return;
+        }
+        slab.lower_face.assign(plane, NO_VOXEL);
+        slab.upper_face.assign(plane, NO_VOXEL);
+
+        std::vector<uint32_t> keys(n);
+        std::vector<uint32_t> order;
+        order.reserve(n);
+        for (uint32_t v = 0; v < n; ++v) {
+            const float x = value(voxels, base + v);
+            keys[v] = value_sort_key(x);
+            if (!std::isnan(x)) {
+                order.push_back(v);
+            }
+        }
+        auto earlier = [&](uint32_t a, uint32_t b) { return keys[a] < keys[b] || (keys[a] == keys[b] && a < b); };
+        std::sort(order.begin(), order.end(), earlier);
+        if (cancel && *cancel) {
+            return;
+        }
+
+        std::vector<uint32_t> parent(n, UNSEEN);
+        std::vector<uint8_t> touches_face(n, 0);
+        if (with_labels) {
+            slab.entry_root.assign(n, UNSEEN);
+        }
+        for (uint32_t v : order) {
+            const int x = int(v % dims.x);
+            const int y = int((v / dims.x) % dims.y);
+            const int z = z0 + int(v / plane);
+            const bool on_lower = z == z0 && z0 > 0;
+            const bool on_upper = z == z1 - 1 && z1 < dims.z;
+            parent[v] = v;
+            touches_face[v] = on_lower || on_upper;
+
+            const uint32_t neighbors[6] = {x > 0 ? v - 1 : UNSEEN,
+                                           x + 1 < dims.x ? v + 1 : UNSEEN,
+                                           y > 0 ? v - dims.x : UNSEEN,
+                                           y + 1 < dims.y ? v + dims.x : UNSEEN,
+                                           z > z0 ? uint32_t(v - plane) : UNSEEN,
+                                           z + 1 < z1 ? uint32_t(v + plane) : UNSEEN};
+            for (uint32_t w : neighbors) {
+                if (w == UNSEEN || parent[w] == UNSEEN) {
+                    continue;
+                }
+                const uint32_t rv = find_root(parent, v);
+                const uint32_t rw = find_root(parent, w);
+                if (rv == rw) {
+                    continue;
+                }
+                const uint32_t elder = earlier(rv, rw) ? rv : rw;
+                const uint32_t younger = elder == rv ? rw : rv;
+                // v joining a component is no merge, v is no minimum
+                const MergeEdge merge{FiltrationKey{keys[v], base + v}, base + elder, base + younger};
+                if (younger == v) {
+                } else if (!touches_face[younger]) {
+                    slab.merges.push_back(merge);
+                } else {
+                    slab.deferred.push_back(merge);
+                }
+                parent[younger] = elder;
+                touches_face[elder] |= touches_face[younger];
+            }
+            if (with_labels) {
+                slab.entry_root[v] = find_root(parent, v);
+            }
+            if (on_lower) {
+                slab.lower_face[v % plane] = base + find_root(parent, v);
+            }
+            if (on_upper) {
+                slab.upper_face[v % plane] = base + find_root(parent, v);
+            }
+        }
+        for (uint32_t v : order) {
+            if (parent[v] == v) {
+                slab.survivors.push_back(base + v);
+            }
+        }
+    }
+
+    template <typename T>
+    void operator()(const T *voxels)
+    {
+        slabs.resize(n_slabs);
+        rkcommon::tasking::parallel_for(n_slabs, [&](int s) { sweep_slab(voxels, s); });
+    }
+};
+
+// Filtration position of a voxel
+template <typename T>
+FiltrationKey filtration_key(const Volume &volume, const T *voxels, uint64_t i)
+{
+    return FiltrationKey{value_sort_key(volume.decode(float(voxels[i]))), i};
+}
+
+struct FaceEdgesFn {
+    const Volume &volume;
+    const std::vector<SlabPersistence> &slabs;
+    std::vector<MergeEdge> edges;
+
+    // Edges across the face between slab s and s + 1, from the voxel pairs
+    // facing each other to the minima of their components
+    template <typename T>
+    void operator()(const T *voxels)
+    {
+        const size_t plane = size_t(volume.dims.x) * volume.dims.y;
+        for (size_t s = 0; s + 1 < slabs.size(); ++s) {
+            const uint64_t z = uint64_t(volume.dims.z) * (s + 1) / slabs.size();
+            for (size_t i = 0; i < plane; ++i) {
+                const uint64_t a = slabs[s].upper_face[i];
+                const uint64_t b = slabs[s + 1].lower_face[i];
+                if (a == NO_VOXEL || b == NO_VOXEL) {
+                    continue;
+                }
+                const FiltrationKey below = filtration_key(volume, voxels, (z - 1) * plane + i);
+                const FiltrationKey above = filtration_key(volume, voxels, z * plane + i);
+                edges.push_back(MergeEdge{below < above ? above : below, a, b});
+            }
+        }
+    }
+};
+
+// Merge tree of the sublevel set components. Every local minimum starts a
+// branch that lasts until it merges into an older branch; branch ids are
+// the positions of the birth voxels in sorted order. With labels, every
+// voxel knows the branch that owned its component when it entered (skipping
+// branches of zero persistence), and the branches are numbered in post-order
+// so the void of a branch is the voxels labelled with one range of numbers.
+struct MergeTree {
+    vec3i dims;
+    std::vector<uint64_t> birth_voxels;
+    // branch merged into, NO_BRANCH for the components that never die
+    std::vector<uint32_t> parent;
+    // voxel whose entry kills the branch, value is max for the roots
+    std::vector<FiltrationKey> death_keys;
+    std::vector<float> birth;
+    // roots die at the volume maximum
+    std::vector<float> death;
+    std::vector<uint64_t> child_offsets;
+    std::vector<uint32_t> children;
+    // per voxel branch, NO_BRANCH for NaN
+    std::shared_ptr<std::vector<uint32_t>> labels;
+    // post-order number of every branch, the subtree of b is numbered
+    // [subtree_begin[b], post_order[b]]
+    std::vector<uint32_t> post_order;
+    std::vector<uint32_t> subtree_begin;
+    // voxels in the subtree of every branch, the roots' own voxels are left
+    // out, they are most of the volume
+    std::vector<uint64_t> void_sizes;
+
+    size_t size() const
+    {
+        return birth_voxels.size();
+    }
+
+    uint32_t branch_of(uint64_t birth_voxel) const
+    {
+        return uint32_t(std::lower_bound(birth_voxels.begin(), birth_voxels.end(), birth_voxel) - birth_voxels.begin());
+    }
+
+    // Branch owning the component of branch b once voxel t has entered
+    uint32_t owner(uint32_t b, const FiltrationKey &t) const
+    {
+        while (parent[b] != NO_BRANCH && !(t < death_keys[b])) {
+            b = parent[b];
+        }
+        return b;
+    }
+
+    bool has_labels() const
+    {
+        return labels != nullptr;
+    }
+
+    // Every stride-th voxel, in index order, labelled with a branch numbered
+    // [first, last) in post-order. Two parallel passes over the labels: a
+    // count per chunk, then the voxels at their rank.
+    std::vector<uint64_t> voxels_numbered(uint32_t first, uint32_t last, size_t stride) const
+    {
+        if (!labels || first >= last) {
+            return std::vector<uint64_t>();
+        }
+        const uint32_t *label = labels->data();
+        const size_t n = labels->size();
+        const size_t n_chunks = (n + SCAN_CHUNK_VOXELS - 1) / SCAN_CHUNK_VOXELS;
+        auto inside = [&](uint32_t b) {
+            return b != NO_BRANCH && post_order[b] >= first && post_order[b] < last;
+        };
+        std::vector<size_t> ranks(n_chunks + 1, 0);
+        rkcommon::tasking::parallel_for(n_chunks, [&](size_t c) {
+            const size_t end = std::min(n, (c + 1) * SCAN_CHUNK_VOXELS);
+            for (size_t i = c * SCAN_CHUNK_VOXELS; i < end; ++i) {
+                ranks[c + 1] += inside(label[i]);
+            }
+        });
+        for (size_t c = 0; c < n_chunks; ++c) {
+            ranks[c + 1] += ranks[c];
+        }
+        std::vector<uint64_t> voxels((ranks.back() + stride - 1) / stride);
+        rkcommon::tasking::parallel_for(n_chunks, [&](size_t c) {
+            const size_t end = std::min(n, (c + 1) * SCAN_CHUNK_VOXELS);
+            size_t rank = ranks[c];
+            for (size_t i = c * SCAN_CHUNK_VOXELS; i < end; ++i) {
+                if (inside(label[i])) {
+                    if (rank % stride == 0) {
+                        voxels[rank / stride] = i;
+                    }
+                    ++rank;
+                }
+            }
+        });
+        return voxels;
+    }
+
+    // Voxels labelled with branch b, every stride-th
+    std::vector<uint64_t> voxels_of(uint32_t b, size_t stride = 1) const
+    {
+        return has_labels() ? voxels_numbered(post_order[b], post_order[b] + 1, stride) : std::vector<uint64_t>();
+    }
+
+    // Number of voxels in the void of branch b, 0 without labels
+    uint64_t void_size(uint32_t b) const
+    {
+        return has_labels() ? void_sizes[b] : 0;
+    }
+
+    // The void a branch stands for, its component just before it merges:
+    // the branch and every branch that merged into it, every stride-th voxel
+    std::vector<uint64_t> void_voxels(uint32_t b, size_t stride = 1) const
+    {
+        if (!has_labels()) {
+            return std::vector<uint64_t>();
+        }
+        const uint32_t last = parent[b] == NO_BRANCH ? post_order[b] : post_order[b] + 1;
+        return voxels_numbered(subtree_begin[b], last, stride);
+    }
+
+    // Pairs with positive persistence and the components that never die,
+    // most persistent first
+    std::vector<PersistencePair> pairs() const
+    {
+        std::vector<PersistencePair> result;
+        for (uint32_t b = 0; b < size(); ++b) {
+            if (parent[b] == NO_BRANCH || death[b] > birth[b]) {
+                result.push_back(PersistencePair{birth[b], death[b], birth_voxels[b], death_keys[b].voxel, b});
+            }
+        }
+        std::sort(result.begin(), result.end(), [](const PersistencePair &a, const PersistencePair &b) {
+            return a.persistence() > b.persistence();
+        });
+        return result;
+    }
+};
+
+// Filtration keys and values of the births, or once the merges are known, values of the deaths
+struct BranchValuesFn {
+    const Volume &volume;
+    MergeTree &tree;
+    bool deaths;
+    std::vector<FiltrationKey> birth_keys;
+
+    template <typename T>
+    void operator()(const T *voxels)
+    {
+        if (deaths) {
+            tree.death.resize(tree.size());
+            rkcommon::tasking::parallel_for(tree.size(), [&](size_t b) {
+                const uint64_t voxel = tree.death_keys[b].voxel;
+                tree.death[b] = voxel == NO_VOXEL ? volume.range.y : volume.decode(float(voxels[voxel]));
+            });
+            return;
+        }
+        birth_keys.resize(tree.size());
+        tree.birth.resize(tree.size());
+        rkcommon::tasking::parallel_for(tree.size(), [&](size_t b) {
+            birth_keys[b] = filtration_key(volume, voxels, tree.birth_voxels[b]);
+            tree.birth[b] = volume.decode(float(voxels[tree.birth_voxels[b]]));
+        });
+    }
+};
+
+// Resolves the slab-local entry roots into branches of the global tree.
+// Branches that die at their birth value (plateaus, e.g. after
+// simplification) hand their voxels to the branch they merge into.
+struct BranchLabelsFn {
+    const Volume &volume;
+    MergeTree &tree;
+    std::vector<SlabPersistence> &slabs;
+    std::vector<uint32_t> labelled;
+
+    template <typename T>
+    void operator()(const T *voxels)
+    {
+        const size_t plane = size_t(volume.dims.x) * volume.dims.y;
+        uint32_t *labels = tree.labels->data();
+        labelled.resize(tree.size());
+        rkcommon::tasking::parallel_for(tree.size(), [&](size_t b) {
+            uint32_t owner = uint32_t(b);
+            while (tree.parent[owner] != NO_BRANCH && !(tree.death[owner] > tree.birth[owner])) {
+                owner = tree.parent[owner];
+            }
+            labelled[b] = owner;
+        });
+        rkcommon::tasking::parallel_for(slabs.size(), [&](size_t s) {
+            const uint64_t base = uint64_t(volume.dims.z) * s / slabs.size() * plane;
+            std::vector<uint32_t> &entry_root = slabs[s].entry_root;
+            // entry roots repeat, remember the last lookup
+            uint32_t last_root = std::numeric_limits<uint32_t>::max();
+            uint32_t last_branch = NO_BRANCH;
+            for (size_t v = 0; v < entry_root.size(); ++v) {
+                if (entry_root[v] == std::numeric_limits<uint32_t>::max()) {
+                    labels[base + v] = NO_BRANCH;
+                    continue;
+                }
+                if (entry_root[v] != last_root) {
+                    last_root = entry_root[v];
+                    last_branch = tree.branch_of(base + last_root);
+                }
+                labels[base + v] = labelled[tree.owner(last_branch, filtration_key(volume, voxels, base + v))];
+            }
+            std::vector<uint32_t>().swap(entry_root);
+        });
+    }
+};
+
+// Numbers the branches in post-order and sums the voxels of every subtree,
+// roots' own voxels excluded
+void number_branches(MergeTree &tree)
+{
+    const std::vector<uint32_t> &labels = *tree.labels;
+    const size_t n = labels.size();
+    const size_t n_chunks = (n + SCAN_CHUNK_VOXELS - 1) / SCAN_CHUNK_VOXELS;
+    auto counted = [&](uint32_t b) { return b != NO_BRANCH && tree.parent[b] != NO_BRANCH; };
+
+    std::vector<std::atomic<uint64_t>> own(tree.size());
+    for (auto &count : own) {
+        count = 0;
+    }
+    rkcommon::tasking::parallel_for(n_chunks, [&](size_t c) {
+        const size_t end = std::min(n, (c + 1) * SCAN_CHUNK_VOXELS);
+        for (size_t i = c * SCAN_CHUNK_VOXELS; i < end; ++i) {
+            if (counted(labels[i])) {
+                ++own[labels[i]];
+            }
+        }
+    });
+
+    // post-order walk from every root, children first then the branch itself
+    tree.post_order.assign(tree.size(), 0);
+    tree.subtree_begin.assign(tree.size(), 0);
+    tree.void_sizes.assign(tree.size(), 0);
+    uint32_t number = 0;
+    std::vector<std::pair<uint32_t, uint64_t>> stack;
+    for (uint32_t root = 0; root < tree.size(); ++root) {
+        if (tree.parent[root] != NO_BRANCH) {
+            continue;
+        }
+        stack.push_back(std::make_pair(root, tree.child_offsets[root]));
+        tree.subtree_begin[root] = number;
+        while (!stack.empty()) {
+            const uint32_t b = stack.back().first;
+            const uint64_t next = stack.back().second;
+            if (next < tree.child_offsets[b + 1]) {
+                ++stack.back().second;
+                const uint32_t child = tree.children[next];
+                tree.subtree_begin[child] = number;
+                stack.push_back(std::make_pair(child, tree.child_offsets[child]));
+                continue;
+            }
+            stack.pop_back();
+            tree.post_order[b] = number++;
+            tree.void_sizes[b] += own[b];
+            if (tree.parent[b] != NO_BRANCH) {
+                tree.void_sizes[tree.parent[b]] += tree.void_sizes[b];
+            }
+        }
+    }
+}
+
+// Slabs along z are swept in parallel, then the merges that involve the slab
+// faces are replayed on the component minima only, a Kruskal pass with the
+// elder rule. with_labels adds the per-voxel branches (4 bytes per voxel),
+// the voids are gathered from them on demand. A raised cancel flag throws
+// LoadCancelled between the passes.
+MergeTree compute_merge_tree(const Volume &volume,
+                             bool with_labels = false,
+                             int n_slabs = 0,
+                             const std::atomic<bool> *cancel = nullptr)
+{
+    auto start = std::chrono::steady_clock::now();
+    const size_t plane = size_t(volume.dims.x) * volume.dims.y;
+    if (n_slabs <= 0) {
+        n_slabs = 2 * std::max(1, int(std::thread::hardware_concurrency()));
+    }
+    // slab-local indices are 32 bit
+    const size_t max_planes = std::max<size_t>(1, std::numeric_limits<uint32_t>::max() / plane - 1);
+    n_slabs = std::max(n_slabs, int((volume.dims.z + max_planes - 1) / max_planes));
+    n_slabs = std::max(1, std::min(n_slabs, volume.dims.z));
+
+    PersistenceFn slabs_fn{volume, n_slabs, with_labels, cancel, {}};
+    dispatch_voxels(volume, slabs_fn);
+    check_cancelled(cancel);
+    FaceEdgesFn faces_fn{volume, slabs_fn.slabs, {}};
+    dispatch_voxels(volume, faces_fn);
+
+    // every local minimum is a branch: the survivors and the younger side of every merge
+    MergeTree tree;
+    tree.dims = volume.dims;
+    std::vector<MergeEdge> merges;
+    std::vector<MergeEdge> &edges = faces_fn.edges;
+    std::vector<uint64_t> &minima = tree.birth_voxels;
+    std::vector<uint64_t> replayed;
+    for (const SlabPersistence &slab : slabs_fn.slabs) {
+        merges.insert(merges.end(), slab.merges.begin(), slab.merges.end());
+        edges.insert(edges.end(), slab.deferred.begin(), slab.deferred.end());
+        replayed.insert(replayed.end(), slab.survivors.begin(), slab.survivors.end());
+        for (const MergeEdge &edge : slab.deferred) {
+            replayed.push_back(edge.b);
+        }
+    }
+    std::sort(replayed.begin(), replayed.end());
+    replayed.erase(std::unique(replayed.begin(), replayed.end()), replayed.end());
+    minima = replayed;
+    for (const MergeEdge &merge : merges) {
+        minima.push_back(merge.b);
+    }
+    std::sort(minima.begin(), minima.end());
+    tree.parent.assign(minima.size(), NO_BRANCH);
+    tree.death_keys.assign(minima.size(), FiltrationKey{std::numeric_limits<uint32_t>::max(), NO_VOXEL});
+    BranchValuesFn values_fn{volume, tree, false, {}};
+    dispatch_voxels(volume, values_fn);
+    const std::vector<FiltrationKey> &birth_keys = values_fn.birth_keys;
+
+    // slab merges are final, the elder may still die first through another slab
+    for (const MergeEdge &merge : merges) {
+        const uint32_t younger = tree.branch_of(merge.b);
+        tree.parent[younger] = tree.branch_of(merge.a);
+        tree.death_keys[younger] = merge.at;
+    }
+
+    // Kruskal over the replayed minima, roots stay the oldest minimum of their component
+    std::sort(edges.begin(), edges.end(), [](const MergeEdge &a, const MergeEdge &b) { return a.at < b.at; });
+    std::vector<uint32_t> root(minima.size());
+    for (uint32_t b = 0; b < root.size(); ++b) {
+        root[b] = b;
+    }
+    for (const MergeEdge &edge : edges) {
+        const uint32_t ra = find_root(root, tree.branch_of(edge.a));
+        const uint32_t rb = find_root(root, tree.branch_of(edge.b));
+        if (ra == rb) {
+            continue;
+        }
+        const uint32_t elder = birth_keys[ra] < birth_keys[rb] ? ra : rb;
+        const uint32_t younger = elder == ra ? rb : ra;
+        root[younger] = elder;
+        tree.parent[younger] = elder;
+        tree.death_keys[younger] = edge.at;
+    }
+    values_fn.deaths = true;
+    dispatch_voxels(volume, values_fn);
+
+    // point every branch at the branch that owned the component it merged into
+    std::vector<uint32_t> owners(tree.size());
+    rkcommon::tasking::parallel_for(tree.size(), [&](size_t b) {
+        owners[b] = tree.parent[b] == NO_BRANCH ? NO_BRANCH : tree.owner(tree.parent[b], tree.death_keys[b]);
+    });
+    tree.parent = owners;
+    tree.child_offsets.assign(tree.size() + 1, 0);
+    for (uint32_t p : tree.parent) {
+        if (p != NO_BRANCH) {
+            ++tree.child_offsets[p + 1];
+        }
+    }
+    for (size_t b = 0; b < tree.size(); ++b) {
+        tree.child_offsets[b + 1] += tree.child_offsets[b];
+    }
+    tree.children.resize(tree.child_offsets.back());
+    std::vector<uint64_t> child_cursor(tree.child_offsets.begin(), tree.child_offsets.end() - 1);
+    for (uint32_t b = 0; b < tree.size(); ++b) {
+        if (tree.parent[b] != NO_BRANCH) {
+            tree.children[child_cursor[tree.parent[b]]++] = b;
+        }
+    }
+
+    if (with_labels) {
+        check_cancelled(cancel);
+        tree.labels = allocate_buffer<uint32_t>(volume.n_voxels(), "branch labels");
+        BranchLabelsFn labels_fn{volume, tree, slabs_fn.slabs, {}};
+        dispatch_voxels(volume, labels_fn);
+        check_cancelled(cancel);
+        number_branches(tree);
+    }
+    print_throughput(with_labels ? "merge tree + labels" : "merge tree", volume.n_voxels() * volume.voxel_size(),
+                     seconds_since(start));
+    std::cout << tree.size() << " branches, " << edges.size() << " merges replayed across " << n_slabs
+              << " slabs" << std::endl;
+    return tree;
+}
+
+// 0-dimensional persistence pairs, most persistent first. Components that
+// never die get the volume maximum as death.
+std::vector<PersistencePair> compute_persistence(const Volume &volume, int n_slabs = 0)
+{
+    return compute_merge_tree(volume, false, n_slabs).pairs();
+}
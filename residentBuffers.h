@@ -0,0 +1,89 @@
+#pragma once
+
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Accounting of every voxel buffer alive in the process, grouped by what
+// created it. Buffers are shared by reference between the loader, the
+// analysis code and OSPRay, so each volume should show up exactly once.
+class ResidentBuffers {
+    struct Usage {
+        size_t buffers = 0;
+        size_t bytes = 0;
+    };
+
+    std::mutex lock;
+    std::map<std::string, Usage> usage;
+
+public:
+    static ResidentBuffers &instance()
+    {
+        static ResidentBuffers buffers;
+        return buffers;
+    }
+
+    void add(const std::string &label, size_t bytes)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Usage &u = usage[label];
+        ++u.buffers;
+        u.bytes += bytes;
+    }
+
+    void remove(const std::string &label, size_t bytes)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Usage &u = usage[label];
+        --u.buffers;
+        u.bytes -= bytes;
+    }
+
+    size_t total_bytes()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t total = 0;
+        for (const auto &u : usage) {
+            total += u.second.bytes;
+        }
+        return total;
+    }
+
+    size_t total_buffers()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t total = 0;
+        for (const auto &u : usage) {
+            total += u.second.buffers;
+        }
+        return total;
+    }
+
+    void print(std::ostream &out)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (const auto &u : usage) {
+            if (u.second.buffers > 0) {
+                out << u.first << ": " << u.second.buffers << " buffers, " << u.second.bytes / double(1 << 20)
+                    << " MB" << std::endl;
+            }
+        }
+    }
+};
+
+// Zero-initialized buffer of n elements that is counted as resident until
+// the last reference to it goes away
+template <typename T>
+std::shared_ptr<std::vector<T>> allocate_buffer(size_t n, const std::string &label)
+{
+    const size_t bytes = n * sizeof(T);
+    std::shared_ptr<std::vector<T>> buffer(new std::vector<T>(n), [label, bytes](std::vector<T> *b) {
+        ResidentBuffers::instance().remove(label, bytes);
+        delete b;
+    });
+    ResidentBuffers::instance().add(label, bytes);
+    return buffer;
+}
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <chrono>
+
+#include "rkcommon/math/vec.h"
+#include "rkcommon/tasking/parallel_for.h"
+
+#include "dataLoader.h"
+#include "brickedVolume.h"
+
+using namespace rkcommon::math;
+
+// LRU cache of decoded bricks bounded by a memory budget in bytes.
+// Bricks handed out stay alive while referenced even if they get evicted.
+class BrickCache {
+    typedef std::shared_ptr<const std::vector<uint8_t>> BrickData;
+
+    struct Entry {
+        BrickData data;
+        std::list<size_t>::iterator lru_pos;
+    };
+
+    const BrickedVolumeFile &file;
+    size_t budget;
+    size_t resident = 0;
+    size_t n_hits = 0;
+    size_t n_misses = 0;
+    std::list<size_t> lru;
+    std::unordered_map<size_t, Entry> entries;
+    mutable std::mutex lock;
+
+    void evict()
+    {
+        while (resident > budget && !lru.empty()) {
+            const size_t victim = lru.back();
+            lru.pop_back();
+            resident -= entries[victim].data->size();
+            entries.erase(victim);
+        }
+    }
+
+public:
+    BrickCache(const BrickedVolumeFile &file, size_t budget) : file(file), budget(budget) {}
+
+    BrickData get(size_t brick)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = entries.find(brick);
+            if (it != entries.end()) {
+                lru.splice(lru.begin(), lru, it->second.lru_pos);
+                ++n_hits;
+                return it->second.data;
+            }
+            ++n_misses;
+        }
+
+        // Read outside the lock so misses on different bricks overlap
+        auto data = allocate_buffer<uint8_t>(file.brick_bytes(brick), "brick cache");
+        file.read_brick(brick, data->data());
+
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(brick);
+        if (it != entries.end()) {
+            return it->second.data;
+        }
+        lru.push_front(brick);
+        entries[brick] = Entry{data, lru.begin()};
+        resident += data->size();
+        evict();
+        return data;
+    }
+
+    size_t resident_bytes() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return resident;
+    }
+
+    size_t budget_bytes() const
+    {
+        return budget;
+    }
+
+    size_t hits() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return n_hits;
+    }
+
+    size_t misses() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return n_misses;
+    }
+};
+
+// Copies the part of a brick that falls inside [lower, upper) into a dense region
+template <typename T>
+void copy_brick_region(const T *brick_voxels,
+                       const BrickInfo &brick,
+                       const vec3i &lower,
+                       const vec3i &upper,
+                       T *region)
+{
+    const vec3i region_dims = upper - lower;
+    const vec3i brick_lower(brick.origin[0], brick.origin[1], brick.origin[2]);
+    const vec3i brick_upper = brick_lower + vec3i(brick.size[0], brick.size[1], brick.size[2]);
+    const vec3i begin = max(lower, brick_lower);
+    const vec3i end = min(upper, brick_upper);
+    if (begin.x >= end.x || begin.y >= end.y || begin.z >= end.z) {
+        return;
+    }
+    for (int z = begin.z; z < end.z; ++z) {
+        for (int y = begin.y; y < end.y; ++y) {
+            const size_t src = (size_t(z - brick_lower.z) * brick.size[1] + (y - brick_lower.y)) * brick.size[0]
+                + (begin.x - brick_lower.x);
+            const size_t dst = (size_t(z - lower.z) * region_dims.y + (y - lower.y)) * region_dims.x
+                + (begin.x - lower.x);
+            std::memcpy(region + dst, brick_voxels + src, (end.x - begin.x) * sizeof(T));
+        }
+    }
+}
+
+// Volume backend for .cvb files that do not fit in memory. Only bricks that
+// are touched are read, through a bounded LRU cache. The budget is split
+// evenly between the cache and the dense region the viewer keeps.
+class StreamingVolume {
+    BrickedVolumeFile file;
+    BrickCache cache;
+
+    struct RegionFn {
+        StreamingVolume &stream;
+        vec3i lower;
+        vec3i upper;
+        void *region;
+
+        template <typename T>
+        void operator()(const T *)
+        {
+            const std::vector<size_t> touched = stream.bricks_in_region(lower, upper);
+            rkcommon::tasking::parallel_for(touched.size(), [&](size_t i) {
+                const size_t b = touched[i];
+                auto data = stream.cache.get(b);
+                copy_brick_region(reinterpret_cast<const T *>(data->data()),
+                                  stream.file.bricks()[b],
+                                  lower,
+                                  upper,
+                                  static_cast<T *>(region));
+            });
+        }
+    };
+
+public:
+    StreamingVolume(const std::string &fname, size_t budget_bytes)
+        : file(fname), cache(file, budget_bytes / 2)
+    {}
+
+    vec3i dims() const
+    {
+        return file.dims();
+    }
+
+    VoxelType voxel_type() const
+    {
+        return file.voxel_type();
+    }
+
+    const BrickedVolumeFile &bricks() const
+    {
+        return file;
+    }
+
+    const BrickCache &brick_cache() const
+    {
+        return cache;
+    }
+
+    // Indices of the bricks overlapping [lower, upper)
+    std::vector<size_t> bricks_in_region(const vec3i &lower, const vec3i &upper) const
+    {
+        const int bs = file.brick_size();
+        const vec3i grid = brick_grid_dims(file.dims(), bs);
+        const vec3i first = lower / bs;
+        const vec3i last = (upper - 1) / bs;
+        std::vector<size_t> touched;
+        for (int bz = first.z; bz <= last.z; ++bz) {
+            for (int by = first.y; by <= last.y; ++by) {
+                for (int bx = first.x; bx <= last.x; ++bx) {
+                    touched.push_back((size_t(bz) * grid.y + by) * grid.x + bx);
+                }
+            }
+        }
+        return touched;
+    }
+
+    // Largest region centered in the volume whose voxels fit in its half of the budget
+    void fit_region(vec3i &lower, vec3i &upper) const
+    {
+        const vec3i dims = file.dims();
+        const size_t voxel_size = voxel_type_size(file.voxel_type());
+        const double full_bytes = double(size_t(dims.x) * dims.y * dims.z * voxel_size);
+        const double scale = std::min(1.0, std::cbrt(cache.budget_bytes() / full_bytes));
+        const vec3i size(std::max(1, int(dims.x * scale)),
+                         std::max(1, int(dims.y * scale)),
+                         std::max(1, int(dims.z * scale)));
+        lower = (dims - size) / 2;
+        upper = lower + size;
+    }
+
+    // Dense voxels of [lower, upper) with the conservative range of the bricks touched
+    Volume read_region(const vec3i &lower, const vec3i &upper)
+    {
+        Volume volume;
+        volume.dims = upper - lower;
+        volume.origin = vec3f(lower) * volume.spacing;
+        volume.voxel_type = file.voxel_type();
+        volume.value_offset = file.value_offset();
+        volume.value_scale = file.value_scale();
+
+        auto voxels = allocate_buffer<uint8_t>(volume.n_voxels() * volume.voxel_size(), "streamed region");
+        volume.voxel_data = std::shared_ptr<const void>(voxels, voxels->data());
+        RegionFn region_fn{*this, lower, upper, voxels->data()};
+        dispatch_voxels(volume, region_fn);
+
+        const std::vector<size_t> touched = bricks_in_region(lower, upper);
+        volume.range = vec2f(file.bricks()[touched[0]].min, file.bricks()[touched[0]].max);
+        for (size_t b : touched) {
+            volume.range.x = std::min(volume.range.x, file.bricks()[b].min);
+            volume.range.y = std::max(volume.range.y, file.bricks()[b].max);
+        }
+        volume.stats.range = volume.range;
+        return volume;
+    }
+
+    // Dense volume of the voxels in [lower, upper), positioned at lower, with full stats
+    Volume load_region(const vec3i &lower, const vec3i &upper)
+    {
+        Volume volume = read_region(lower, upper);
+        auto start = std::chrono::steady_clock::now();
+        // quantized files hold codes, the scans see those and are decoded after
+        VolumeStatsFn stats_fn{volume.n_voxels(), nullptr, VolumeStats()};
+        dispatch_voxels(volume, stats_fn);
+        VolumeStats &stats = stats_fn.stats;
+        stats.range = vec2f(volume.decode(stats.range.x), volume.decode(stats.range.y));
+        stats.mean = volume.value_offset + double(volume.value_scale) * stats.mean;
+        stats.variance *= double(volume.value_scale) * volume.value_scale;
+        volume.stats = stats;
+        VolumeSummaryFn summary_fn{volume, volume.stats, BrickRanges()};
+        dispatch_voxels(volume, summary_fn);
+        for (vec2f &range : summary_fn.bricks.ranges) {
+            range = vec2f(volume.decode(range.x), volume.decode(range.y));
+        }
+        volume.brick_ranges = std::make_shared<BrickRanges>(summary_fn.bricks);
+        volume.range = volume.stats.range;
+        print_throughput("stats + histogram", volume.n_voxels() * volume.voxel_size(), seconds_since(start));
+        print_volume_stats(volume.stats);
+        return volume;
+    }
+
+    // Visit the whole volume as z slabs one brick deep, only one slab is dense
+    // at a time. Slabs only carry the range of their bricks.
+    void for_each_slab(const std::function<void(const Volume &)> &fn)
+    {
+        const vec3i dims = file.dims();
+        const int depth = file.brick_size();
+        for (int z = 0; z < dims.z; z += depth) {
+            const Volume slab = read_region(vec3i(0, 0, z), vec3i(dims.x, dims.y, std::min(dims.z, z + depth)));
+            fn(slab);
+        }
+    }
+};
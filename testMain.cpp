@@ -22,6 +22,9 @@
 #endif
 
 #include <vector>
+#include <limits>
+#include <future>
+#include <atomic>
 
 // OpenGL
 #include <GL/gl3w.h>
@@ -42,11 +45,33 @@
 #include "ArcballCamera.h"
 #include "parseArgs.h"
 #include "dataLoader.h"
+#include "volumeFormats.h"
+#include "brickedVolume.h"
+#include "streamingVolume.h"
+#include "asyncLoader.h"
+#include "timeSeries.h"
+#include "volumePyramid.h"
+#include "volumeQuantize.h"
+#include "isoLevels.h"
+#include "valueIndex.h"
+#include "brickIntervals.h"
+#include "persistence.h"
+#include "barcodeFile.h"
+#include "volumeSimplify.h"
 #include "ospray_volume.h"
 
 
 using namespace rkcommon::math;
 
+// voxel budget of the preview shown while the full volume loads
+const size_t PREVIEW_VOXELS = 128 * 128 * 128;
+// full resolution comes back once the camera has been still this long
+const double LOD_SETTLE_SECONDS = 0.3;
+// voxels of a selected void drawn as spheres, the rest are skipped by a stride
+const size_t MAX_VOID_SPHERES = size_t(1) << 18;
+// particles drawn with -spheres, the rest are skipped by a stride
+const size_t MAX_PARTICLE_SPHERES = size_t(1) << 20;
+
 const std::string fullscreen_quad_vs = R"(
 #version 420 core
 const vec4 pos[4] = vec4[4](
@@ -98,17 +123,167 @@ void writePPM(const char *fileName, const vec2i &size, const uint32_t *pixel)
   fclose(file);
 }
 
+// What the background barcode job hands back. With -simplify the tree is
+// the one of the simplified volume, so labels and bars follow it.
+struct BarcodeResult {
+  MergeTree tree;
+  Volume simplified;
+};
+
+// Bars of the widget, in the order of the pairs (most persistent first)
+std::shared_ptr<const BarList> makeBars(const MergeTree &tree)
+{
+  std::vector<Bar> bars;
+  for (const PersistencePair &pair : tree.pairs()) {
+    bars.push_back(Bar(pair.birth, pair.death, int(pair.branch), pair.birth_voxel, tree.void_size(pair.branch)));
+  }
+  return std::make_shared<BarVector>(std::move(bars));
+}
+
+// Bars read straight from the records of a barcode, which stays mapped as
+// long as the widget lists them
+class BarcodeBars : public BarList {
+  Barcode barcode;
+
+public:
+  explicit BarcodeBars(const Barcode &barcode) : barcode(barcode) {}
+
+  size_t size() const override
+  {
+    return barcode.size();
+  }
+
+  Bar operator[](size_t i) const override
+  {
+    const BarcodeRecord &record = barcode[i];
+    return Bar(record.birth, record.death, -1,
+               barcode.flags & BARCODE_HAS_VOXELS ? record.birth_voxel : NO_BAR_VOXEL,
+               barcode.flags & BARCODE_HAS_VOID_SIZES ? record.void_voxels : 0);
+  }
+};
+
 int main(int argc, const char **argv)
 {
 	Args args;
     parseArgs(argc, argv, args);
 
 	// Load raw data 
-	Volume volume = load_raw_volume(args.filename, args.dims, args.dtype);
-    // load json file for barcode
-    std::vector<Bar> bars = getBarcode();
-    for(int i = 0; i < 5; i++){
-        std::cout << bars[i].birth << " " << bars[i].death << " " << bars[i].birth - bars[i].death << std::endl;
+	LoadOptions load_options;
+	load_options.use_mmap = args.mmap;
+	load_options.to_float32 = args.to_float32;
+	load_options.use_cache = args.use_cache;
+	load_options.read_streams = args.read_streams;
+	load_options.readahead = args.readahead;
+	// raised when the viewer closes so a load still running gives up
+	std::atomic<bool> cancel_load(false);
+	load_options.cancel = &cancel_load;
+	// Streaming keeps only the bricks of a region of interest in memory
+	std::shared_ptr<StreamingVolume> stream;
+	// The volume loads in the background, a coarse preview is shown first
+	std::function<Volume()> load_preview;
+	std::function<Volume()> load_full;
+	// Optional lossy uint8/uint16 copy to cut the resident footprint
+	auto quantize_loaded = [=](const Volume &exact) -> Volume {
+		if (args.quantize.empty()) {
+			return exact;
+		}
+		const VoxelType quantized_type = parse_voxel_type(args.quantize);
+		return exact.voxel_size() > voxel_type_size(quantized_type) ? quantize_volume(exact, quantized_type) : exact;
+	};
+	// -roi crops the volume, only the voxels inside it are read
+	const bool use_roi = reduce_max(args.roi_upper) > 0;
+	// Time series keep the snapshots around the current step decoded ahead
+	std::shared_ptr<SeriesPrefetcher> series;
+	// Particle snapshots are deposited onto a grid, kept only to draw them as spheres
+	std::shared_ptr<Particles> particles;
+	if (args.series_last >= args.series_first) {
+		// -roi crops every snapshot the same way
+		auto load_step = [=](int step) -> Volume {
+			const std::string fname = series_filename(args.filename, step);
+			if (args.extension == "cvb" && use_roi) {
+				StreamingVolume bricks(fname, args.budget_mb << 20);
+				vec3i roi_lower = args.roi_lower, roi_upper = args.roi_upper;
+				clamp_region(roi_lower, roi_upper, bricks.dims());
+				return quantize_loaded(bricks.load_region(roi_lower, roi_upper));
+			} else if (args.extension == "cvb") {
+				return quantize_loaded(load_bricked_volume(fname));
+			}
+			const RawVolumeLayout layout = describe_volume_file(fname, args.extension, args.dims, args.dtype);
+			if (use_roi) {
+				return quantize_loaded(load_raw_region(layout, args.roi_lower, args.roi_upper));
+			}
+			return quantize_loaded(load_raw_volume(layout, load_options));
+		};
+		series = std::make_shared<SeriesPrefetcher>(load_step, args.series_first, args.series_last, args.prefetch);
+		load_full = [=]() { return series->wait(args.series_first); };
+	} else if (args.particles) {
+		ParticleLayout particle_layout;
+		particle_layout.fname = args.filename;
+		particle_layout.has_mass = args.particle_mass;
+		particle_layout.box_size = args.box_size;
+		const vec3i grid_dims = reduce_max(args.dims) > 0 ? args.dims : vec3i(128);
+		const DepositScheme scheme = parse_deposit_scheme(args.deposit);
+		if (args.spheres) {
+			particles = std::make_shared<Particles>(load_particles(particle_layout, args.read_streams));
+		}
+		load_full = [=]() {
+			return deposit_particles(
+				particles ? *particles : load_particles(particle_layout, args.read_streams), grid_dims, scheme);
+		};
+	} else if (args.stream) {
+		stream = std::make_shared<StreamingVolume>(args.filename, args.budget_mb << 20);
+		vec3i roi_lower = args.roi_lower, roi_upper = args.roi_upper;
+		if (use_roi) {
+			clamp_region(roi_lower, roi_upper, stream->dims());
+		} else {
+			stream->fit_region(roi_lower, roi_upper);
+		}
+		std::cout << "streaming region " << roi_lower << " to " << roi_upper
+			<< " of " << stream->dims() << std::endl;
+		load_full = [=]() { return stream->load_region(roi_lower, roi_upper); };
+	} else if (args.extension == "cvb" && use_roi) {
+		// only the bricks overlapping the crop are read
+		load_full = [=]() {
+			StreamingVolume bricks(args.filename, args.budget_mb << 20);
+			vec3i roi_lower = args.roi_lower, roi_upper = args.roi_upper;
+			clamp_region(roi_lower, roi_upper, bricks.dims());
+			return bricks.load_region(roi_lower, roi_upper);
+		};
+	} else if (args.extension == "cvb") {
+		std::shared_ptr<BrickedVolumeFile> bricked = std::make_shared<BrickedVolumeFile>(args.filename);
+		load_preview = [=]() { return load_brick_preview(*bricked); };
+		load_full = [=]() { return load_bricked_volume(args.filename); };
+	} else {
+		const RawVolumeLayout layout = describe_volume_file(args.filename, args.extension, args.dims, args.dtype);
+		if (use_roi) {
+			load_full = [=]() { return load_raw_region(layout, args.roi_lower, args.roi_upper); };
+		} else {
+			const int stride = preview_stride(layout.dims, PREVIEW_VOXELS);
+			if (stride > 1) {
+				load_preview = [=]() { return load_raw_preview(layout, stride); };
+			}
+			load_full = [=]() { return load_raw_volume(layout, load_options); };
+		}
+	}
+	if (!args.quantize.empty() && !args.stream && !series) {
+		std::function<Volume()> load_exact = load_full;
+		load_full = [=]() { return quantize_loaded(load_exact()); };
+	}
+	AsyncVolumeLoader loader(load_preview, load_full, cancel_load);
+	bool volume_full = false;
+	bool load_failed = false;
+	Volume volume = loader.wait_first(volume_full);
+    // barcode of the voids, computed from the full volume in the background
+    std::shared_ptr<const BarList> bars = std::make_shared<BarVector>();
+    // merge tree behind the bars, maps a selected bar to the voxels of its void
+    MergeTree merge_tree;
+    // -barcode shows a precomputed barcode, none is computed then
+    if (!args.barcode.empty()) {
+        const Barcode barcode = load_barcode(args.barcode);
+        bars = std::make_shared<BarcodeBars>(barcode);
+        if (!args.save_barcode.empty()) {
+            write_barcode_file(barcode, args.save_barcode);
+        }
     }
 
     // image size
@@ -126,6 +301,10 @@ int main(int argc, const char **argv)
     TransferFunctionWidget transferFcnWidget;
     float default_iso = 0.f;
     Widget widget(range.x, range.y, default_iso, bars);
+    widget.setLevelCount(args.iso_levels);
+    if (series) {
+        widget.setTimeSteps(series->first_step(), series->last_step());
+    }
     int total = (range.y - range.x) / 0.1f;
 
 
@@ -210,9 +389,47 @@ int main(int argc, const char **argv)
 		//! Transfer function
 		// const std::string colormap = "jet";
         auto colormap = transferFcnWidget.get_colormap();
-		ospray::cpp::TransferFunction transfer_function = makeTransferFunction(colormap, range);
+		ospray::cpp::TransferFunction transfer_function = makeTransferFunction(colormap, storedValueRange(volume, range));
 		//! Volume
-		ospray::cpp::Volume osp_volume = createStructuredVolume(volume);
+		// -vdb hands OSPRay only the leaves below a threshold ("-vdb 0.2"),
+		// raised to the iso value so every isosurface drawn lies in the leaves
+		const bool use_vdb = args.vdb;
+		SparseVolume sparse_volume;
+		auto create_render_volume = [&](const Volume &next) -> ospray::cpp::Volume {
+			if (!use_vdb) {
+				return createStructuredVolume(next);
+			}
+			sparse_volume = createSparseVolume(next, std::max(args.vdb_threshold, widget.getIsoValue()));
+			return sparse_volume.volume;
+		};
+		ospray::cpp::Volume osp_volume = create_render_volume(volume);
+		//! Coarser pyramid levels rendered while the camera moves
+		// (not for time series, a pyramid per snapshot would throttle playback)
+		const bool lod_enabled = args.lod != "off" && !series;
+		const DownsampleFilter lod_filter = args.lod == "max" ? DownsampleFilter::MAX : DownsampleFilter::BOX;
+		VolumePyramid pyramid;
+		std::vector<ospray::cpp::Volume> osp_levels;
+		int render_level = 0;
+		auto last_camera_change = std::chrono::steady_clock::now();
+		auto rebuild_pyramid = [&]() {
+			VolumePyramid next;
+			next.levels.assign(1, volume);
+			if (volume_full && lod_enabled) {
+				auto start = std::chrono::steady_clock::now();
+				next = build_volume_pyramid(volume, lod_filter);
+				std::cout << "built " << next.levels.size() << " pyramid levels in "
+					<< seconds_since(start) << " s" << std::endl;
+			}
+			// the OSPRay levels share the voxels of the old pyramid, drop them first
+			std::vector<ospray::cpp::Volume> next_levels(1, osp_volume);
+			for (size_t i = 1; i < next.levels.size(); ++i) {
+				next_levels.push_back(createStructuredVolume(next.levels[i]));
+			}
+			osp_levels = next_levels;
+			pyramid = next;
+			render_level = 0;
+		};
+		rebuild_pyramid();
 		//! Volume Model
 		ospray::cpp::VolumetricModel volume_model(osp_volume);
 		volume_model.setParam("transferFunction", transfer_function);
@@ -228,7 +445,49 @@ int main(int argc, const char **argv)
         mat.setParam("map_kd", volume_texture);
         mat.commit();
 
-        std::vector<float> iso_values = getAllIsoValues(volume, default_iso);
+        // a bounded set of levels below the iso value, picked from the
+        // histogram the loader built with the voxels
+        IsoLevelSet iso_levels;
+        iso_levels.adopt(volume);
+        std::vector<float> iso_values = iso_levels.levels(volume.encode(default_iso), widget.getLevelCount());
+        // raised when the window closes so the background jobs give up
+        std::atomic<bool> cancel_jobs(false);
+        // -value-index sorts the voxels of every volume on a background thread,
+        // the set below the iso value then follows the slider by binary search
+        // over the sorted values. Until the index is ready the brick intervals
+        // count instead.
+        std::shared_ptr<ExcursionSet> excursion;
+        std::future<std::shared_ptr<ExcursionSet>> index_job;
+        bool index_stale = false;
+        auto rebuild_value_index = [&]() {
+            if (!args.value_index) {
+                return;
+            }
+            excursion.reset();
+            if (index_job.valid()) {
+                index_stale = true;
+                return;
+            }
+            const Volume snapshot = volume;
+            const float threshold = widget.getIsoValue();
+            std::atomic<bool> *cancel = &cancel_jobs;
+            index_job = std::async(std::launch::async, [snapshot, threshold, cancel]() {
+                return std::make_shared<ExcursionSet>(SortedValueIndex(snapshot, cancel), threshold);
+            });
+            index_stale = false;
+        };
+        rebuild_value_index();
+        // without the index the count below the iso value comes from the brick
+        // min/max, only bricks straddling the iso value are scanned
+        BrickIntervals brick_intervals;
+        ThresholdCount below_iso;
+        auto rebuild_brick_intervals = [&]() {
+            brick_intervals = volume.brick_ranges ? BrickIntervals(volume.brick_ranges) : BrickIntervals();
+            if (!excursion && !brick_intervals.empty()) {
+                below_iso = count_voxels_below(volume, brick_intervals, widget.getIsoValue());
+            }
+        };
+        rebuild_brick_intervals();
         ospray::cpp::Geometry isoGeom("isosurface");
         isoGeom.setParam("isovalue", ospray::cpp::CopiedData(iso_values));
         isoGeom.setParam("volume", osp_volume);
@@ -243,8 +502,16 @@ int main(int argc, const char **argv)
 		// put the model into a group (collection of models)
 		ospray::cpp::Group group;
 		// group.setParam("volume", ospray::cpp::CopiedData(volume_model));
-        group.setParam("geometry", ospray::cpp::CopiedData(isoModel));
+        std::vector<ospray::cpp::GeometricModel> models{isoModel};
+        if (particles) {
+            ospray::cpp::GeometricModel sphereModel(createParticleSpheres(*particles, volume, MAX_PARTICLE_SPHERES));
+            sphereModel.commit();
+            models.push_back(sphereModel);
+        }
+        group.setParam("geometry", ospray::cpp::CopiedData(models));
 		group.commit();
+        // the selected void goes after the fixed models
+        const size_t fixed_models = models.size();
 
         // put the group into an instance (give the group a world transform)
         ospray::cpp::Instance instance(group);
@@ -278,6 +545,70 @@ int main(int argc, const char **argv)
         glfwSetWindowUserPointer(window, app.get());
         glfwSetCursorPosCallback(window, cursorPosCallback);
 
+        // one barcode computation at a time, a volume swapped in meanwhile is
+        // picked up once it finishes
+        std::future<BarcodeResult> barcode_job;
+        bool barcode_stale = false;
+        auto start_barcode = [&]() {
+            if (!args.barcode.empty()) {
+                return;
+            }
+            if (barcode_job.valid()) {
+                barcode_stale = true;
+                return;
+            }
+            const Volume snapshot = volume;
+            const float simplify = args.simplify;
+            std::atomic<bool> *cancel = &cancel_jobs;
+            barcode_job = std::async(std::launch::async, [snapshot, simplify, cancel]() {
+                BarcodeResult result;
+                result.tree = compute_merge_tree(snapshot, true, 0, cancel);
+                if (simplify > 0.f) {
+                    result.simplified = simplify_volume(snapshot, result.tree, simplify, cancel);
+                    result.tree = compute_merge_tree(result.simplified, true, 0, cancel);
+                }
+                return result;
+            });
+            barcode_stale = false;
+        };
+        if (volume_full) {
+            start_barcode();
+        }
+
+        // point the scene at new voxels, the OSPRay objects are kept and recommitted
+        auto swap_volume = [&](const Volume &next) {
+            // OSPRay shares the voxels, so repoint it before the old buffer is released
+            if (use_vdb) {
+                osp_volume = create_render_volume(next);
+            } else {
+                updateStructuredVolume(osp_volume, next);
+            }
+            volume = next;
+            widget.setRange(range.x, range.y);
+            rebuild_pyramid();
+            volume_model.setParam("volume", osp_volume);
+            isoGeom.setParam("volume", osp_volume);
+            transfer_function.setParam("valueRange", storedValueRange(volume, range));
+            transfer_function.commit();
+            volume_model.commit();
+            volume_texture.commit();
+            iso_levels.adopt(volume);
+            rebuild_value_index();
+            rebuild_brick_intervals();
+            iso_values = iso_levels.levels(volume.encode(widget.getIsoValue()), widget.getLevelCount());
+            isoGeom.setParam("isovalue", ospray::cpp::CopiedData(iso_values));
+            isoGeom.commit();
+            isoModel.commit();
+            group.commit();
+            instance.commit();
+            world.commit();
+            framebuffer.clear();
+        };
+        int current_step = args.series_first;
+        int target_step = current_step;
+        // a time step failed to load and its message is in the panel
+        bool step_failed = false;
+
         while (!glfwWindowShouldClose(window))
         {
             app -> isTransferFcnChanged = transferFcnWidget.changed();
@@ -287,10 +618,39 @@ int main(int argc, const char **argv)
             // std::cout << app ->showIsosurfaces << std::endl;
             if(app ->isIsoValueChanged){
                 float iso_value = widget.getIsoValue();
-                iso_values = getAllIsoValues(volume, iso_value);
-                isoGeom.setParam("isovalue", ospray::cpp::CopiedData(iso_values));
-                isoGeom.commit();
-                framebuffer.clear();
+                if (use_vdb && iso_value > sparse_volume.threshold) {
+                    // cover some headroom too, so dragging the slider up only
+                    // rebuilds the vdb nodes every eighth of the range
+                    sparse_volume = createSparseVolume(
+                        volume, iso_value + (range.y - range.x) / 8.f, sparse_volume.leaf_ranges);
+                    osp_volume = sparse_volume.volume;
+                    osp_levels[0] = osp_volume;
+                    if (render_level == 0) {
+                        volume_model.setParam("volume", osp_volume);
+                        volume_model.commit();
+                        volume_texture.commit();
+                        isoGeom.setParam("volume", osp_volume);
+                        isoGeom.commit();
+                        isoModel.commit();
+                        group.commit();
+                        instance.commit();
+                        world.commit();
+                        framebuffer.clear();
+                    }
+                }
+                if (excursion) {
+                    excursion->move_to(iso_value);
+                } else if (!brick_intervals.empty()) {
+                    below_iso = count_voxels_below(volume, brick_intervals, iso_value);
+                }
+                // only walks the cumulative histogram, no pass over the voxels
+                std::vector<float> next_values = iso_levels.levels(volume.encode(iso_value), widget.getLevelCount());
+                if (next_values != iso_values) {
+                    iso_values = next_values;
+                    isoGeom.setParam("isovalue", ospray::cpp::CopiedData(iso_values));
+                    isoGeom.commit();
+                    framebuffer.clear();
+                }
                 app ->isIsoValueChanged = false;
             }  
             // if(app ->showVolume){
@@ -304,6 +664,112 @@ int main(int argc, const char **argv)
             // }
             // rkcommon::containers::TransactionalBuffer<OSPObject> objectsToCommit;
 
+            // swap in the full resolution volume once the loader publishes it
+            Volume loaded;
+            bool loaded_full = false;
+            if (!volume_full && loader.poll(loaded, loaded_full)) {
+                volume_full = loaded_full;
+                range = loaded.range;
+                swap_volume(loaded);
+                if (volume_full) {
+                    start_barcode();
+                }
+            } else if (!volume_full && !load_failed && loader.finished()) {
+                // the preview stays up, the failure goes to the panel
+                load_failed = true;
+                widget.setStatus("Full volume failed to load: " + loader.failure());
+            }
+
+            // step through the time series, playback only moves onto snapshots
+            // that are already decoded so it runs at render speed
+            if (series && volume_full) {
+                if (widget.timeStepChanged()) {
+                    target_step = widget.getTimeStep();
+                    series->set_current(target_step);
+                } else if (widget.isPlaying() && target_step == current_step) {
+                    target_step = series->next_step(current_step);
+                }
+                Volume snapshot;
+                if (target_step != current_step && series->try_get(target_step, snapshot)) {
+                    current_step = target_step;
+                    series->set_current(current_step);
+                    widget.setTimeStep(current_step);
+                    // grow the range so colors stay comparable across snapshots
+                    range = vec2f(std::min(range.x, snapshot.range.x), std::max(range.y, snapshot.range.y));
+                    swap_volume(snapshot);
+                    start_barcode();
+                    if (step_failed) {
+                        widget.setStatus("");
+                        step_failed = false;
+                    }
+                } else if (target_step != current_step) {
+                    const std::string failure = series->failure(target_step);
+                    if (!failure.empty()) {
+                        // keep showing the current step, playback skips over the broken one
+                        widget.setStatus("Time step " + std::to_string(target_step) + " failed to load: " + failure);
+                        step_failed = true;
+                        target_step = widget.isPlaying() ? series->next_step(target_step) : current_step;
+                        series->set_current(target_step);
+                        widget.setTimeStep(current_step);
+                    }
+                }
+            }
+            if (index_job.valid() && index_job.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                try {
+                    std::shared_ptr<ExcursionSet> ready = index_job.get();
+                    if (index_stale) {
+                        rebuild_value_index();
+                    } else {
+                        // only the voxels between the job's threshold and the slider are visited
+                        ready->move_to(widget.getIsoValue());
+                        excursion = ready;
+                    }
+                } catch (const std::exception &e) {
+                    widget.setStatus(std::string("Value index failed: ") + e.what());
+                }
+            }
+            if (barcode_job.valid() && barcode_job.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                try {
+                    BarcodeResult result = barcode_job.get();
+                    merge_tree = std::move(result.tree);
+                    widget.setBars(makeBars(merge_tree));
+                    // isosurfaces follow the simplified field, unless a newer volume came in meanwhile
+                    if (result.simplified.voxel_data && !barcode_stale) {
+                        swap_volume(result.simplified);
+                    }
+                    if (!args.save_barcode.empty()) {
+                        write_barcode_file(make_barcode(merge_tree), args.save_barcode);
+                    }
+                } catch (const std::exception &e) {
+                    widget.setStatus(std::string("Barcode failed: ") + e.what());
+                }
+                if (barcode_stale) {
+                    start_barcode();
+                }
+            }
+            if (widget.barSelectionChanged()) {
+                models.resize(fixed_models);
+                const int selected = widget.getSelectedBar();
+                const int branch = selected >= 0 ? widget.getBar(selected).branch : -1;
+                if (branch >= 0 && merge_tree.has_labels() && merge_tree.dims == volume.dims) {
+                    // only the voxels that get a sphere are gathered
+                    const size_t stride = std::max<size_t>(
+                        1, (merge_tree.void_size(uint32_t(branch)) + MAX_VOID_SPHERES - 1) / MAX_VOID_SPHERES);
+                    const std::vector<uint64_t> voxels = merge_tree.void_voxels(uint32_t(branch), stride);
+                    ospray::cpp::GeometricModel voidModel(createVoxelSpheres(
+                        voxels.data(), voxels.data() + voxels.size(), volume, MAX_VOID_SPHERES));
+                    voidModel.setParam("material", mat);
+                    voidModel.setParam("color", vec4f(3/255.f, 15/255.f, 252/255.f, 1.f));
+                    voidModel.commit();
+                    models.push_back(voidModel);
+                }
+                group.setParam("geometry", ospray::cpp::CopiedData(models));
+                group.commit();
+                instance.commit();
+                world.commit();
+                framebuffer.clear();
+            }
+
             if (app ->isCameraChanged) {
                 camera.setParam("position", app->camera.eyePos());
                 camera.setParam("direction", app->camera.lookDir());
@@ -314,6 +780,24 @@ int main(int argc, const char **argv)
                 camera.commit();
                 framebuffer.clear();
                 app ->isCameraChanged = false;
+                last_camera_change = std::chrono::steady_clock::now();
+            }
+
+            // sample a coarser level while the camera moves
+            const bool interacting = seconds_since(last_camera_change) < LOD_SETTLE_SECONDS;
+            const int level = select_pyramid_level(pyramid, app->camera, imgSize, interacting);
+            if (level != render_level) {
+                render_level = level;
+                volume_model.setParam("volume", osp_levels[level]);
+                volume_model.commit();
+                volume_texture.commit();
+                isoGeom.setParam("volume", osp_levels[level]);
+                isoGeom.commit();
+                isoModel.commit();
+                group.commit();
+                instance.commit();
+                world.commit();
+                framebuffer.clear();
             }
             // if (app -> isTransferFcnChanged) {
             //     // std::cout << "transfer function changed!" << std::endl;
@@ -339,6 +823,34 @@ int main(int argc, const char **argv)
 
             if(ImGui::Begin("Control Panel")){
                 ImGui::Text("Density Range: %.3f to %.3f", range.x, range.y);
+                if (!volume_full) {
+                    ImGui::Text("Loading full resolution...");
+                }
+                if (series && target_step != current_step) {
+                    ImGui::Text("Loading time step %d...", target_step);
+                }
+                if (barcode_job.valid()) {
+                    ImGui::Text("Computing barcode...");
+                }
+                if (index_job.valid()) {
+                    ImGui::Text("Indexing values...");
+                }
+                if (excursion) {
+                    ImGui::Text("Below iso: %zu voxels (%.2f%%), mean %.3f",
+                                excursion->voxels(), 100.0 * excursion->fraction(), excursion->mean());
+                } else if (!brick_intervals.empty()) {
+                    ImGui::Text("Below iso: %zu voxels, %zu of %zu bricks scanned",
+                                below_iso.voxels, below_iso.bricks_scanned, brick_intervals.n_bricks());
+                }
+                if (use_vdb) {
+                    ImGui::Text("Sparse volume: %zu of %zu leaves, %.1f of %.1f MB, %.1f MB copied",
+                                sparse_volume.n_leaves, sparse_volume.total_leaves,
+                                sparse_volume.leaf_bytes / double(1 << 20), sparse_volume.dense_bytes / double(1 << 20),
+                                sparse_volume.copied_bytes / double(1 << 20));
+                }
+                ImGui::Text("Resident voxels: %.1f MB in %zu buffers",
+                            ResidentBuffers::instance().total_bytes() / double(1 << 20),
+                            ResidentBuffers::instance().total_buffers());
                 widget.draw();
             }
             
@@ -365,6 +877,7 @@ int main(int argc, const char **argv)
             glfwSwapBuffers(window);
             glfwPollEvents();
         }
+        cancel_jobs = true;
 
     }
 
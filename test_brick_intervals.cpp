@@ -0,0 +1,118 @@
+// Checks count_voxels_below against a count over every voxel, on a volume
+// with NaN and +/-Inf voxels in bricks whose finite range lies on either
+// side of the threshold, with the brick ranges of a dense load, of a
+// bricked file and without per-brick NaN/Inf counts
+//   test_brick_intervals
+
+#include <iostream>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "dataLoader.h"
+#include "brickedVolume.h"
+#include "brickIntervals.h"
+
+const float INF = std::numeric_limits<float>::infinity();
+const float NaN = std::numeric_limits<float>::quiet_NaN();
+
+// Values rise with z, so the bricks of a 32^3 grid lie above or below most
+// thresholds. The first brick is all NaN, the last all -Inf, and a few
+// voxels of the low and high bricks are NaN, +Inf or -Inf.
+Volume make_test_volume(const vec3i &dims)
+{
+    auto voxels = std::make_shared<std::vector<float>>(size_t(dims.x) * dims.y * dims.z);
+    size_t i = 0;
+    for (int z = 0; z < dims.z; ++z) {
+        for (int y = 0; y < dims.y; ++y) {
+            for (int x = 0; x < dims.x; ++x, ++i) {
+                float value = float(z) + 0.01f * float((x * 7 + y * 3) % 50);
+                if (x < 32 && y < 32 && z < 32) {
+                    value = NaN;
+                } else if (x >= 64 && y >= 32 && z >= 64) {
+                    value = -INF;
+                } else if (i % 997 == 0) {
+                    value = INF;
+                } else if (i % 1009 == 0) {
+                    value = -INF;
+                } else if (i % 1013 == 0) {
+                    value = NaN;
+                }
+                (*voxels)[i] = value;
+            }
+        }
+    }
+    Volume volume;
+    volume.dims = dims;
+    volume.voxel_data = std::shared_ptr<const void>(voxels, voxels->data());
+    VolumeStatsFn stats_fn{volume.n_voxels(), nullptr, VolumeStats()};
+    dispatch_voxels(volume, stats_fn);
+    volume.stats = stats_fn.stats;
+    VolumeSummaryFn summary_fn{volume, volume.stats, BrickRanges()};
+    dispatch_voxels(volume, summary_fn);
+    volume.brick_ranges = std::make_shared<BrickRanges>(summary_fn.bricks);
+    volume.range = volume.stats.range;
+    return volume;
+}
+
+size_t brute_force_below(const Volume &volume, float threshold)
+{
+    const float *voxels = volume.voxels<float>();
+    size_t count = 0;
+    for (size_t i = 0; i < volume.n_voxels(); ++i) {
+        count += voxels[i] < threshold;
+    }
+    return count;
+}
+
+int check_counts(const std::string &name, const Volume &volume)
+{
+    int failures = 0;
+    const BrickIntervals intervals(volume.brick_ranges);
+    for (float threshold : {-INF, -1.f, 0.f, 10.5f, 31.99f, 32.f, 50.f, 95.f, 96.f, 200.f, INF}) {
+        const size_t expected = brute_force_below(volume, threshold);
+        const ThresholdCount counted = count_voxels_below(volume, intervals, threshold);
+        if (counted.voxels != expected) {
+            std::cout << "FAIL " << name << ", below " << threshold << ": " << counted.voxels << " voxels, expected "
+                      << expected << std::endl;
+            ++failures;
+        }
+    }
+    return failures;
+}
+
+int main()
+{
+    int failures = 0;
+    const Volume volume = make_test_volume(vec3i(96, 64, 96));
+    failures += check_counts("dense", volume);
+
+    Volume unknown = volume;
+    BrickRanges ranges = *volume.brick_ranges;
+    ranges.n_nan.clear();
+    ranges.n_inf.clear();
+    unknown.brick_ranges = std::make_shared<BrickRanges>(ranges);
+    failures += check_counts("no per-brick counts", unknown);
+
+    const std::string fname = "test_brick_intervals.cvb";
+    BrickWriteOptions options;
+    options.brick_size = 32;
+    write_bricked_volume(volume, fname, options);
+    const Volume bricked = load_bricked_volume(fname);
+    std::remove(fname.c_str());
+    if (bricked.stats.n_nan != volume.stats.n_nan || bricked.stats.n_inf != volume.stats.n_inf) {
+        std::cout << "FAIL bricked stats: " << bricked.stats.n_nan << " NaN and " << bricked.stats.n_inf
+                  << " Inf, expected " << volume.stats.n_nan << " and " << volume.stats.n_inf << std::endl;
+        ++failures;
+    }
+    failures += check_counts("bricked", bricked);
+
+    if (failures) {
+        std::cout << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "voxel counts below the threshold match" << std::endl;
+    return 0;
+}
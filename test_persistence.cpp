@@ -0,0 +1,185 @@
+// Checks that the merge tree does not depend on the slab split: the tree of
+// one slab is compared against several slab counts on small synthetic volumes
+// with ties, plateaus and NaN voxels. Also checks that simplification leaves
+// no more branches than the pairs it keeps.
+//   test_persistence
+
+#include <iostream>
+#include <random>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+#include "dataLoader.h"
+#include "persistence.h"
+#include "volumeSimplify.h"
+
+template <typename T>
+Volume make_volume(const vec3i &dims, std::shared_ptr<std::vector<T>> voxels, VoxelType voxel_type)
+{
+    Volume volume;
+    volume.dims = dims;
+    volume.voxel_type = voxel_type;
+    volume.voxel_data = std::shared_ptr<const void>(voxels, voxels->data());
+    VolumeStatsFn stats_fn{volume.n_voxels(), nullptr, VolumeStats()};
+    dispatch_voxels(volume, stats_fn);
+    volume.stats = stats_fn.stats;
+    volume.range = volume.stats.range;
+    return volume;
+}
+
+// Four levels only, most neighbours tie and equal values form plateaus
+Volume few_levels_volume(const vec3i &dims)
+{
+    std::mt19937 rng(7);
+    auto voxels = std::make_shared<std::vector<uint8_t>>(size_t(dims.x) * dims.y * dims.z);
+    for (uint8_t &v : *voxels) {
+        v = uint8_t(rng() % 4);
+    }
+    return make_volume(dims, voxels, VoxelType::UINT8);
+}
+
+// Smooth field cut flat below a level, with some NaN voxels, including whole
+// rows that split components
+Volume plateau_volume(const vec3i &dims)
+{
+    std::mt19937 rng(11);
+    auto voxels = std::make_shared<std::vector<float>>(size_t(dims.x) * dims.y * dims.z);
+    size_t i = 0;
+    for (int z = 0; z < dims.z; ++z) {
+        for (int y = 0; y < dims.y; ++y) {
+            for (int x = 0; x < dims.x; ++x, ++i) {
+                const float value = std::sin(0.7f * x) * std::cos(0.5f * y) + std::sin(0.9f * z);
+                (*voxels)[i] = std::max(value, -0.8f);
+                if (rng() % 50 == 0 || (y == dims.y / 2 && z % 3 == 0)) {
+                    (*voxels)[i] = std::numeric_limits<float>::quiet_NaN();
+                }
+            }
+        }
+    }
+    return make_volume(dims, voxels, VoxelType::FLOAT32);
+}
+
+// Slab faces add branches of zero persistence (voxels that are only minima
+// within their slab), so the trees are compared on what they are used for:
+// the pairs, the labels and the voids, all through the birth voxels
+bool same_tree(const MergeTree &a, const MergeTree &b, std::string &why)
+{
+    // equal persistences may come in either order
+    auto by_birth = [](const PersistencePair &p, const PersistencePair &q) { return p.birth_voxel < q.birth_voxel; };
+    std::vector<PersistencePair> pairs_a = a.pairs();
+    std::vector<PersistencePair> pairs_b = b.pairs();
+    std::sort(pairs_a.begin(), pairs_a.end(), by_birth);
+    std::sort(pairs_b.begin(), pairs_b.end(), by_birth);
+    if (pairs_a.size() != pairs_b.size()) {
+        why = std::to_string(pairs_a.size()) + " vs " + std::to_string(pairs_b.size()) + " pairs";
+        return false;
+    }
+    for (size_t i = 0; i < pairs_a.size(); ++i) {
+        const PersistencePair &pa = pairs_a[i];
+        const PersistencePair &pb = pairs_b[i];
+        if (pa.birth_voxel != pb.birth_voxel || pa.death_voxel != pb.death_voxel || pa.birth != pb.birth
+            || pa.death != pb.death) {
+            why = "pair " + std::to_string(i) + " differs";
+            return false;
+        }
+    }
+    if (a.has_labels() != b.has_labels()) {
+        why = "labels on one side only";
+        return false;
+    }
+    if (!a.has_labels()) {
+        return true;
+    }
+    for (size_t v = 0; v < a.labels->size(); ++v) {
+        const uint32_t la = (*a.labels)[v];
+        const uint32_t lb = (*b.labels)[v];
+        const uint64_t owner_a = la == NO_BRANCH ? NO_VOXEL : a.birth_voxels[la];
+        const uint64_t owner_b = lb == NO_BRANCH ? NO_VOXEL : b.birth_voxels[lb];
+        if (owner_a != owner_b) {
+            why = "label of voxel " + std::to_string(v) + " differs";
+            return false;
+        }
+    }
+    for (size_t i = 0; i < pairs_a.size(); ++i) {
+        const std::vector<uint64_t> void_a = a.void_voxels(pairs_a[i].branch);
+        if (void_a.size() != a.void_size(pairs_a[i].branch) || void_a != b.void_voxels(pairs_b[i].branch)) {
+            why = "void of pair " + std::to_string(i) + " differs";
+            return false;
+        }
+    }
+    return true;
+}
+
+int check_slabs(const std::string &name, const Volume &volume)
+{
+    int failures = 0;
+    for (bool with_labels : {false, true}) {
+        const MergeTree reference = compute_merge_tree(volume, with_labels, 1);
+        for (int n_slabs : {2, 3, 5, 8, volume.dims.z, volume.dims.z + 4}) {
+            const MergeTree tree = compute_merge_tree(volume, with_labels, n_slabs);
+            std::string why;
+            if (!same_tree(reference, tree, why)) {
+                std::cout << "FAIL " << name << (with_labels ? " with labels" : "") << ", " << n_slabs
+                          << " slabs: " << why << std::endl;
+                ++failures;
+            }
+        }
+    }
+    return failures;
+}
+
+// The tree of the simplified volume has a branch per pair kept and no more:
+// flattened voids must not come back as branches of zero persistence
+int check_simplified(const std::string &name, const Volume &volume, float threshold)
+{
+    const MergeTree tree = compute_merge_tree(volume, true, 1);
+    size_t kept = 0;
+    for (const PersistencePair &pair : tree.pairs()) {
+        kept += pair.persistence() >= threshold || tree.parent[pair.branch] == NO_BRANCH;
+    }
+    const MergeTree simplified = compute_merge_tree(simplify_volume(volume, tree, threshold), false, 1);
+    if (simplified.size() > kept) {
+        std::cout << "FAIL " << name << " simplified below " << threshold << ": " << simplified.size()
+                  << " branches for " << kept << " pairs kept" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main()
+{
+    int failures = 0;
+    const Volume few_levels = few_levels_volume(vec3i(23, 17, 19));
+    failures += check_slabs("few levels", few_levels);
+    const Volume plateaus = plateau_volume(vec3i(31, 26, 21));
+    failures += check_slabs("plateaus and NaN", plateaus);
+    failures += check_slabs("thin", plateau_volume(vec3i(40, 40, 3)));
+
+    // simplification leaves plateaus at the cancelled saddles
+    const MergeTree tree = compute_merge_tree(plateaus, true, 1);
+    failures += check_slabs("simplified", simplify_volume(plateaus, tree, 0.5f));
+    for (float threshold : {0.1f, 0.5f, 1.f}) {
+        failures += check_simplified("plateaus and NaN", plateaus, threshold);
+    }
+    failures += check_simplified("few levels", few_levels, 1.5f);
+
+    // a raised flag gives up before the slabs are swept
+    const std::atomic<bool> cancel(true);
+    try {
+        compute_merge_tree(plateaus, true, 4, &cancel);
+        std::cout << "FAIL cancelled merge tree finished" << std::endl;
+        ++failures;
+    } catch (const LoadCancelled &) {
+    }
+
+    if (failures) {
+        std::cout << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "merge trees match for every slab count" << std::endl;
+    return 0;
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <stdexcept>
+#include <cstdio>
+
+#include "dataLoader.h"
+
+// File name of one snapshot, the pattern holds a printf integer field,
+// e.g. snapshot_%03d.raw
+std::string series_filename(const std::string &pattern, int step)
+{
+    char buffer[4096];
+    const int n = std::snprintf(buffer, sizeof(buffer), pattern.c_str(), step);
+    if (n < 0 || n >= int(sizeof(buffer))) {
+        throw std::runtime_error("Bad time series pattern " + pattern);
+    }
+    return std::string(buffer);
+}
+
+// Keeps the snapshots around the current time step decoded on a background
+// thread. The window covers the current step and radius steps on each side,
+// wrapping around so looped playback never waits on the first snapshot.
+// Steps that leave the window are dropped, so at most 2 * radius + 1
+// snapshots are resident. A step that fails to load keeps its error while it
+// is in the window, it does not stop the other steps from loading.
+class SeriesPrefetcher {
+    std::function<Volume(int)> load_step;
+    int first;
+    int count;
+    int radius;
+
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable loaded_cond;
+    std::map<int, Volume> ring;
+    // why a step in the window failed to load, it is retried once it left
+    std::map<int, std::string> failed;
+    int current;
+    bool quit = false;
+
+    int wrap(int step) const
+    {
+        return first + ((step - first) % count + count) % count;
+    }
+
+    // Steps in load priority: current, then forward, then backward
+    std::vector<int> window() const
+    {
+        std::vector<int> steps(1, current);
+        for (int d = 1; d <= radius && int(steps.size()) < count; ++d) {
+            steps.push_back(wrap(current + d));
+            if (int(steps.size()) < count) {
+                steps.push_back(wrap(current - d));
+            }
+        }
+        return steps;
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while (!quit) {
+            const std::vector<int> wanted = window();
+            for (auto it = ring.begin(); it != ring.end();) {
+                if (std::find(wanted.begin(), wanted.end(), it->first) == wanted.end()) {
+                    it = ring.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            for (auto it = failed.begin(); it != failed.end();) {
+                if (std::find(wanted.begin(), wanted.end(), it->first) == wanted.end()) {
+                    it = failed.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            auto missing = std::find_if(wanted.begin(), wanted.end(), [this](int step) {
+                return ring.find(step) == ring.end() && failed.find(step) == failed.end();
+            });
+            if (missing == wanted.end()) {
+                wake.wait(guard);
+                continue;
+            }
+
+            // Decode without the lock, the viewer keeps taking ready steps
+            const int step = *missing;
+            guard.unlock();
+            Volume volume;
+            std::string load_error;
+            try {
+                volume = load_step(step);
+            } catch (const std::exception &e) {
+                load_error = e.what();
+            } catch (...) {
+                load_error = "unknown error";
+            }
+            guard.lock();
+            if (!load_error.empty()) {
+                std::cout << "time step " << step << " failed to load: " << load_error << std::endl;
+                failed[step] = load_error;
+            } else {
+                ring[step] = volume;
+            }
+            loaded_cond.notify_all();
+        }
+    }
+
+public:
+    SeriesPrefetcher(std::function<Volume(int)> load_step, int first, int last, int radius)
+        : load_step(load_step), first(first), count(last - first + 1), radius(radius), current(first)
+    {
+        if (count < 1) {
+            throw std::runtime_error("Empty time series");
+        }
+        worker = std::thread([this]() { run(); });
+    }
+
+    SeriesPrefetcher(const SeriesPrefetcher &) = delete;
+    SeriesPrefetcher &operator=(const SeriesPrefetcher &) = delete;
+
+    ~SeriesPrefetcher()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            quit = true;
+        }
+        wake.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    int first_step() const
+    {
+        return first;
+    }
+
+    int last_step() const
+    {
+        return first + count - 1;
+    }
+
+    int next_step(int step) const
+    {
+        return wrap(step + 1);
+    }
+
+    // Recenter the prefetch window
+    void set_current(int step)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        current = wrap(step);
+        wake.notify_all();
+    }
+
+    // Non-blocking, false if the step is not decoded yet or failed
+    bool try_get(int step, Volume &volume)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = ring.find(wrap(step));
+        if (it == ring.end()) {
+            return false;
+        }
+        volume = it->second;
+        return true;
+    }
+
+    // Why the step failed to load, empty if it did not (yet)
+    std::string failure(int step)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = failed.find(wrap(step));
+        return it == failed.end() ? std::string() : it->second;
+    }
+
+    // Recenter on step and block until it is decoded, throws if it fails
+    Volume wait(int step)
+    {
+        set_current(step);
+        std::unique_lock<std::mutex> guard(lock);
+        loaded_cond.wait(guard, [&]() {
+            return ring.find(wrap(step)) != ring.end() || failed.find(wrap(step)) != failed.end();
+        });
+        auto it = failed.find(wrap(step));
+        if (it != failed.end()) {
+            throw std::runtime_error("Time step " + std::to_string(step) + " failed to load: " + it->second);
+        }
+        return ring[wrap(step)];
+    }
+
+    size_t resident_steps()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return ring.size();
+    }
+};
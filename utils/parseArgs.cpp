@@ -24,6 +24,65 @@ void parseArgs(int argc, const char **argv, Args &args)
             args.dims.z = std::stoi(argv[++i]);
         }else if(arg == "-dtype"){
             args.dtype = argv[++i];
+        }else if(arg == "-mmap"){
+            args.mmap = true;
+        }else if(arg == "-float32"){
+            args.to_float32 = true;
+        }else if(arg == "-no-cache"){
+            args.use_cache = false;
+        }else if(arg == "-streams"){
+            args.read_streams = std::stoi(argv[++i]);
+        }else if(arg == "-no-readahead"){
+            args.readahead = false;
+        }else if(arg == "-o"){
+            args.output = argv[++i];
+        }else if(arg == "-brick"){
+            args.brick_size = std::stoi(argv[++i]);
+        }else if(arg == "-codec"){
+            args.codec = argv[++i];
+        }else if(arg == "-quantize"){
+            args.quantize = argv[++i];
+        }else if(arg == "-stream"){
+            args.stream = true;
+        }else if(arg == "-budget"){
+            args.budget_mb = std::stoul(argv[++i]);
+        }else if(arg == "-lod"){
+            args.lod = argv[++i];
+        }else if(arg == "-series"){
+            args.series_first = std::stoi(argv[++i]);
+            args.series_last = std::stoi(argv[++i]);
+        }else if(arg == "-roi"){
+            args.roi_lower.x = std::stoi(argv[++i]);
+            args.roi_lower.y = std::stoi(argv[++i]);
+            args.roi_lower.z = std::stoi(argv[++i]);
+            args.roi_upper.x = std::stoi(argv[++i]);
+            args.roi_upper.y = std::stoi(argv[++i]);
+            args.roi_upper.z = std::stoi(argv[++i]);
+        }else if(arg == "-prefetch"){
+            args.prefetch = std::stoi(argv[++i]);
+        }else if(arg == "-iso-levels"){
+            args.iso_levels = std::stoi(argv[++i]);
+        }else if(arg == "-value-index"){
+            args.value_index = true;
+        }else if(arg == "-particles"){
+            args.particles = true;
+        }else if(arg == "-mass"){
+            args.particle_mass = true;
+        }else if(arg == "-box"){
+            args.box_size = std::stof(argv[++i]);
+        }else if(arg == "-deposit"){
+            args.deposit = argv[++i];
+        }else if(arg == "-spheres"){
+            args.spheres = true;
+        }else if(arg == "-vdb"){
+            args.vdb = true;
+            args.vdb_threshold = std::stof(argv[++i]);
+        }else if(arg == "-barcode"){
+            args.barcode = argv[++i];
+        }else if(arg == "-save-barcode"){
+            args.save_barcode = argv[++i];
+        }else if(arg == "-simplify"){
+            args.simplify = std::stof(argv[++i]);
         }
     }
     // find file extension
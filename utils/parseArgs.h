@@ -11,8 +11,48 @@ struct Args
 {
     std::string extension;
     std::string filename;
-    vec3i dims;
+    vec3i dims{0};
     std::string dtype;
+    bool mmap = false;
+    bool to_float32 = false;
+    bool use_cache = true;
+    int read_streams = 8;
+    bool readahead = true;
+    std::string output;
+    int brick_size = 64;
+    std::string codec = "none";
+    // lossy uint8/uint16 storage, empty keeps the native type
+    std::string quantize;
+    bool stream = false;
+    size_t budget_mb = 4096;
+    std::string lod = "box";
+    // time series, -f is then a printf pattern such as snap_%03d.raw
+    int series_first = 0;
+    int series_last = -1;
+    int prefetch = 2;
+    // isosurfaces drawn below the iso value
+    int iso_levels = 16;
+    // sort voxels by value for instant threshold statistics
+    bool value_index = false;
+    // particle snapshot deposited onto a -dims grid
+    bool particles = false;
+    bool particle_mass = false;
+    float box_size = 0.f;
+    std::string deposit = "cic";
+    bool spheres = false;
+    // renders a sparse vdb volume of the leaves below vdb_threshold instead of the dense volume
+    bool vdb = false;
+    float vdb_threshold = 0.f;
+    // barcode file (.cvbar or legacy .json) shown instead of computing one
+    std::string barcode;
+    // writes the shown barcode as .cvbar once it is known
+    std::string save_barcode;
+    // cancels the pairs below this persistence in the rendered field, 0 keeps
+    // it. Works on the computed barcode, not with -barcode
+    float simplify = 0.f;
+    // region of interest [roi_lower, roi_upper), empty loads everything
+    vec3i roi_lower{0};
+    vec3i roi_upper{0};
 };
 
 std::string getFileExt(const std::string& s);
@@ -1,13 +1,24 @@
 #include "widget.h"
 
-Widget::Widget(float begin, float end, float default_iso, std::vector<Bar> bars)
-    :range_start{begin}, range_end(end), iso(default_iso), bars(bars)
-{}
+Widget::Widget(float begin, float end, float default_iso, std::shared_ptr<const BarList> bars)
+    :range_start{begin}, range_end(end), iso(default_iso)
+{
+    setBars(bars);
+}
 
 void Widget::draw()
 {
+    if(!status.empty()){
+        ImGui::TextColored(ImVec4(1.f, 0.4f, 0.3f, 1.f), "%s", status.c_str());
+    }
     ImGui::SliderFloat("Delta", &iso, range_start, range_end); 
-    if(range_start != pre_iso){
+    const bool levelCountChanged = ImGui::SliderInt("Iso Levels", &levelCount, 1, 64);
+    isTimeStepChanged = false;
+    if(endTimeStep >= beginTimeStep){
+        isTimeStepChanged = ImGui::SliderInt("Time Step", &currentTimeStep, beginTimeStep, endTimeStep);
+        ImGui::Checkbox("Play", &playing);
+    }
+    if(iso != pre_iso || levelCountChanged){
         isoValueChanged = true;
     }else{
         // std::cout << "current time step " << currentTimeStep << " and pre time step " << preTimeStep << std::endl; 
@@ -21,8 +32,6 @@ void Widget::draw()
     }
     // ImGui::Checkbox("Show Iso-surfaces", &show_isosurfaces); 
     // ImGui::Checkbox("Show Volume", &show_volume);
-    float space = 2;
-    float height = 10;
     
     // if (ImGui::TreeNode("Barcodes"))
     // {
@@ -48,74 +57,101 @@ void Widget::draw()
     // }
     if (ImGui::TreeNode("Barcodes"))
     {
-        // Vertical scroll functions
-        // HelpMarker("Use SetScrollHereY() or SetScrollFromPosY() to scroll to a given vertical position.");
-
-        static int track_item = 50;
-        static bool enable_track = true;
-        static bool enable_extra_decorations = false;
-        static float scroll_to_off_px = 0.0f;
-        static float scroll_to_pos_px = 200.0f;
-
-        ImGuiStyle& style = ImGui::GetStyle();
-        float child_w = (ImGui::GetContentRegionAvail().x - 4 * style.ItemSpacing.x) / 5;
-        if (child_w < 1.0f)
-            child_w = 1.0f;
-        ImGui::PushID("##VerticalScrolling");
-        for(int i = 0; i < bars.size(); i++){
-            ImVec2 p = ImGui::GetCursorScreenPos();
-            // ImGui::TextUnformatted();
-            // std::cout << "p" << p.x << " " << p.y << std::endl;
-            ImGui::Text("%.3f, %.3f", bars[i].birth, bars[i].death);
-            // ImGui::SameLine(140);
-            float x = p.x + 140;
-            float y = p.y + i * (height + space);
-            float diff = bars[i].birth - bars[i].death;
-            ImGui::GetWindowDrawList()->AddRectFilled(ImVec2(x, y), ImVec2(x + diff * 3, y + height), IM_COL32(252, 94, 3, 255));
-            // ImGui::GetWindowDrawList()->AddRectFilled(ImVec2(p.x + 40, p.y + 40), ImVec2(p.x + 70, p.y + 70), IM_COL32_WHITE);
+        drawBarList();
+        ImGui::TreePop();
+    }
+}
+
+static float barSortValue(const Bar &bar, int key){
+    return key == SORT_BIRTH ? bar.birth : key == SORT_DEATH ? bar.death : bar.persistence();
+}
+
+void Widget::sortBars(){
+    const BarList &list = *bars;
+    const int key = barSortKey;
+    const bool descending = barSortDescending;
+    // the values are gathered once, the comparisons do not go through the list
+    std::vector<float> values(list.size());
+    sortedBars.resize(list.size());
+    for(int i = 0; i < int(list.size()); i++){
+        values[i] = barSortValue(list[i], key);
+        sortedBars[i] = i;
+    }
+    std::sort(sortedBars.begin(), sortedBars.end(), [&](int a, int b){
+        if(values[a] != values[b]){
+            return descending ? values[a] > values[b] : values[a] < values[b];
         }
+        return a < b;
+    });
+    sortedBarsStale = false;
+    shownBarsStale = true;
+}
 
+void Widget::filterBars(){
+    const BarList &list = *bars;
+    shownBars.clear();
+    for(int i : sortedBars){
+        const Bar bar = list[i];
+        if(bar.persistence() >= persistenceFilter[0] && bar.persistence() <= persistenceFilter[1]
+           && bar.birth >= birthFilter[0] && bar.birth <= birthFilter[1]
+           && bar.death >= deathFilter[0] && bar.death <= deathFilter[1]){
+            shownBars.push_back(i);
+        }
+    }
+    shownBarsStale = false;
+}
 
-            // ImGui::BeginGroup();
-            // const char* names[] = { "Top", "25%", "Center", "75%", "Bottom" };
-            // ImGui::TextUnformatted(names[0]);
-
-            // const ImGuiWindowFlags child_flags = enable_extra_decorations ? ImGuiWindowFlags_MenuBar : 0;
-            // const ImGuiID child_id = ImGui::GetID((void*)(intptr_t)0);
-            // const bool child_is_visible = ImGui::BeginChild(child_id, ImVec2(child_w, 200.0f), true, child_flags);
-            // if (ImGui::BeginMenuBar())
-            // {
-            //     ImGui::TextUnformatted("abc");
-            //     ImGui::EndMenuBar();
-            // }
-            // if (scroll_to_off)
-            //     ImGui::SetScrollY(scroll_to_off_px);
-            // if (scroll_to_pos)
-            //     ImGui::SetScrollFromPosY(ImGui::GetCursorStartPos().y + scroll_to_pos_px, 0 * 0.25f);
-            // if (child_is_visible) // Avoid calling SetScrollHereY when running with culled items
-            // {
-            //     for (int item = 0; item < 100; item++)
-            //     {
-            //         if (enable_track && item == track_item)
-            //         {
-            //             ImGui::TextColored(ImVec4(1, 1, 0, 1), "Item %d", item);
-            //             ImGui::SetScrollHereY(0 * 0.25f); // 0.0f:top, 0.5f:center, 1.0f:bottom
-            //         }
-            //         else
-            //         {
-            //             ImGui::Text("Item %d", item);
-            //         }
-            //     }
-            // }
-            // float scroll_y = ImGui::GetScrollY();
-            // float scroll_max_y = ImGui::GetScrollMaxY();
-            // ImGui::EndChild();
-            // ImGui::Text("%.0f/%.0f", scroll_y, scroll_max_y);
-            // ImGui::EndGroup();
-     
-        ImGui::PopID();
-        ImGui::TreePop();
+// Sort and filter controls over a clipped list, only the visible rows are
+// submitted so the frame cost does not grow with the number of bars
+void Widget::drawBarList(){
+    float height = 10;
+    sortedBarsStale |= ImGui::Combo("Sort By", &barSortKey, "Persistence\0Birth\0Death\0");
+    sortedBarsStale |= ImGui::Checkbox("Descending", &barSortDescending);
+    const float speed = std::max(maxPersistence, 1e-6f) / 1000.f;
+    shownBarsStale |= ImGui::DragFloatRange2("Persistence", &persistenceFilter[0], &persistenceFilter[1], speed);
+    shownBarsStale |= ImGui::DragFloatRange2("Birth", &birthFilter[0], &birthFilter[1], speed);
+    shownBarsStale |= ImGui::DragFloatRange2("Death", &deathFilter[0], &deathFilter[1], speed);
+    if(sortedBarsStale){
+        sortBars();
+    }
+    if(shownBarsStale){
+        filterBars();
+    }
+    ImGui::Text("%d of %d bars", int(shownBars.size()), int(bars->size()));
+    if(selectedBar >= 0){
+        const Bar bar = (*bars)[selectedBar];
+        ImGui::Text("Selected: %.3f, %.3f", bar.birth, bar.death);
+        if(bar.voxel != NO_BAR_VOXEL){
+            ImGui::Text("Born at voxel %llu", (unsigned long long)bar.voxel);
+        }
+        if(bar.voidVoxels > 0){
+            ImGui::Text("Void of %llu voxels", (unsigned long long)bar.voidVoxels);
+        }
+    }
+
+    ImGui::BeginChild("##bars", ImVec2(0, 300), true);
+    const float barWidth = std::max(1.f, ImGui::GetContentRegionAvail().x - 140);
+    ImGuiListClipper clipper;
+    clipper.Begin(int(shownBars.size()), ImGui::GetTextLineHeightWithSpacing());
+    while(clipper.Step()){
+        for(int row = clipper.DisplayStart; row < clipper.DisplayEnd; row++){
+            const int i = shownBars[row];
+            const Bar bar = (*bars)[i];
+            ImVec2 p = ImGui::GetCursorScreenPos();
+            char label[64];
+            snprintf(label, sizeof(label), "%.3f, %.3f##bar%d", bar.birth, bar.death, i);
+            if(ImGui::Selectable(label, selectedBar == i)){
+                // clicking the selected bar again clears the selection
+                selectedBar = selectedBar == i ? -1 : i;
+                isBarSelectionChanged = true;
+            }
+            // bars are scaled to the most persistent one
+            float x = p.x + 140;
+            float length = maxPersistence > 0 ? barWidth * bar.persistence() / maxPersistence : 0;
+            ImGui::GetWindowDrawList()->AddRectFilled(ImVec2(x, p.y), ImVec2(x + length, p.y + height), IM_COL32(252, 94, 3, 255));
+        }
     }
+    ImGui::EndChild();
 }
 
 bool Widget::changed(){
@@ -126,31 +162,82 @@ float Widget::getIsoValue(){
     return iso;
 }
 
-std::vector<Bar> getBarcode()
-{
-    std::ifstream jsonFile("/home/mengjiao/Desktop/projects/cosmic-void-viewer/data/real_original.json");
-    if(!jsonFile){
-        std::cout << "Cannot open json file" << std::endl;
-    }
-    json parsed_json = nlohmann::json::parse(jsonFile);
+void Widget::setRange(float begin, float end){
+    range_start = begin;
+    range_end = end;
+    iso = std::min(std::max(iso, range_start), range_end);
+}
 
-    std::vector<Bar> bars;
-    for (json::iterator it = parsed_json.begin(); it != parsed_json.end(); ++it) {
-        auto value = it.value();
-        Bar temp_bar(value["birth"], value["death"]);
-        bars.push_back(temp_bar);
+void Widget::setBars(std::shared_ptr<const BarList> bars){
+    this->bars = bars;
+    isBarSelectionChanged = selectedBar != -1;
+    selectedBar = -1;
+    // filters open up to the full range of the new bars
+    maxPersistence = 0;
+    for(int k = 0; k < 2; k++){
+        persistenceFilter[k] = birthFilter[k] = deathFilter[k] = 0;
     }
-    // sort bars 
-    std::sort(bars.begin(), bars.end(), [](const Bar &a, const Bar &b){
-        float a_diff = a.birth - a.death;
-        float b_diff = b.birth - b.death;
-        return a_diff > b_diff;
-    });
+    for(size_t i = 0; i < bars->size(); i++){
+        const Bar bar = (*bars)[i];
+        if(i == 0){
+            birthFilter[0] = birthFilter[1] = bar.birth;
+            deathFilter[0] = deathFilter[1] = bar.death;
+        }
+        birthFilter[0] = std::min(birthFilter[0], bar.birth);
+        birthFilter[1] = std::max(birthFilter[1], bar.birth);
+        deathFilter[0] = std::min(deathFilter[0], bar.death);
+        deathFilter[1] = std::max(deathFilter[1], bar.death);
+        maxPersistence = std::max(maxPersistence, bar.persistence());
+    }
+    persistenceFilter[1] = maxPersistence;
+    sortedBarsStale = true;
+}
 
-    // for(int i = 0; i < bars.size(); i++){
-    //     std::cout << bars[i].birth - bars[i].death << std::endl;
-    // }
+bool Widget::barSelectionChanged(){
+    // reported once, also when new bars drop the selection
+    const bool selectionChanged = isBarSelectionChanged;
+    isBarSelectionChanged = false;
+    return selectionChanged;
+}
+
+int Widget::getSelectedBar(){
+    return selectedBar;
+}
+
+Bar Widget::getBar(int i){
+    return (*bars)[i];
+}
+
+void Widget::setTimeSteps(int begin, int end){
+    beginTimeStep = begin;
+    endTimeStep = end;
+    currentTimeStep = begin;
+}
+
+bool Widget::timeStepChanged(){
+    return isTimeStepChanged;
+}
+
+int Widget::getTimeStep(){
+    return currentTimeStep;
+}
 
-    return bars;
+void Widget::setTimeStep(int step){
+    currentTimeStep = step;
 }
 
+bool Widget::isPlaying(){
+    return playing;
+}
+
+void Widget::setLevelCount(int count){
+    levelCount = std::max(1, count);
+}
+
+int Widget::getLevelCount(){
+    return levelCount;
+}
+
+void Widget::setStatus(const std::string &message){
+    status = message;
+}
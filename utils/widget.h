@@ -2,40 +2,104 @@
 
 #include <iostream>
 #include <mutex>
+#include <memory>
 #include <vector> 
-#include <fstream>
+#include <string>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
 
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
-#include "json.hpp"
 
-using json = nlohmann::json;
+// voxel of a bar that does not know where it was born
+const uint64_t NO_BAR_VOXEL = ~uint64_t(0);
 
 struct Bar
 {
     float birth;
     float death;
-    Bar(float b, float d){
+    // merge tree branch of the bar, -1 when it has no voxels to show
+    int branch;
+    // voxel index of the birth, NO_BAR_VOXEL when unknown
+    uint64_t voxel;
+    // voxels in the void of the bar, 0 when unknown
+    uint64_t voidVoxels;
+    Bar(float b, float d, int br = -1, uint64_t v = NO_BAR_VOXEL, uint64_t vv = 0){
         birth = b;
         death = d;
+        branch = br;
+        voxel = v;
+        voidVoxels = vv;
     }
+    // length of the bar, whichever way round birth and death are
+    float persistence() const{
+        return std::fabs(birth - death);
+    }
+};
+
+// Bars the widget lists, read in place so a large barcode is not copied
+class BarList{
+    public:
+        virtual ~BarList(){}
+        virtual size_t size() const = 0;
+        virtual Bar operator[](size_t i) const = 0;
+};
+
+// Bars held in memory
+class BarVector : public BarList{
+    std::vector<Bar> bars;
+    public:
+        BarVector(std::vector<Bar> bars = std::vector<Bar>()) : bars(std::move(bars)){}
+        size_t size() const override{
+            return bars.size();
+        }
+        Bar operator[](size_t i) const override{
+            return bars[i];
+        }
 };
 
-std::vector<Bar> getBarcode();
+// What the barcode list is sorted by
+enum BarSortKey { SORT_PERSISTENCE = 0, SORT_BIRTH, SORT_DEATH };
 
 class Widget{
-    // float preTimeStep = 1;
-    // float currentTimeStep = 1;
-    // float beginTimeStep = 1;
-    // float endTimeStep = 1;
-    // bool timeStepChanged = false;
+    int currentTimeStep = 0;
+    int beginTimeStep = 0;
+    int endTimeStep = -1;
+    bool isTimeStepChanged = false;
+    bool playing = false;
     float range_start = 0;
     float range_end = 0;
     float iso = 0;
     float pre_iso = 0;
     bool isoValueChanged = false;
-    std::vector<Bar> bars;
+    int levelCount = 16;
+    // problem reported by the background work, shown until replaced
+    std::string status;
+    std::shared_ptr<const BarList> bars;
+    int selectedBar = -1;
+    bool isBarSelectionChanged = false;
+    // indices into bars in sort order, only re-sorted when the bars or the
+    // order change
+    std::vector<int> sortedBars;
+    bool sortedBarsStale = true;
+    // rows of the barcode list, sortedBars that pass the filters. Dragging
+    // a filter only repeats this pass, not the sort.
+    std::vector<int> shownBars;
+    bool shownBarsStale = true;
+    int barSortKey = SORT_PERSISTENCE;
+    bool barSortDescending = true;
+    // [min, max] filters, reset to the full range by setBars
+    float persistenceFilter[2] = {0, 0};
+    float birthFilter[2] = {0, 0};
+    float deathFilter[2] = {0, 0};
+    float maxPersistence = 0;
+
+    void sortBars();
+    void filterBars();
+    void drawBarList();
 
     // bool doUpdate{false}; // no initial update
     // std::shared_ptr<tfn::tfn_widget::TransferFunctionWidget> widget;
@@ -44,9 +108,28 @@ class Widget{
     public:
         // bool show_isosurfaces = true;
         // bool show_volume = false;
-        Widget(float begin, float end, float default_iso, std::vector<Bar> bars);
+        Widget(float begin, float end, float default_iso, std::shared_ptr<const BarList> bars);
         void draw();
         bool changed();
         float getIsoValue();   
+        void setRange(float begin, float end);
+        // the list is kept, not copied
+        void setBars(std::shared_ptr<const BarList> bars);
+        // bar clicked in the barcode list, -1 for none. The change is
+        // reported once, also when new bars drop the selection
+        bool barSelectionChanged();
+        int getSelectedBar();
+        Bar getBar(int i);
+        // time series controls, hidden unless end >= begin
+        void setTimeSteps(int begin, int end);
+        bool timeStepChanged();
+        int getTimeStep();
+        void setTimeStep(int step);
+        bool isPlaying();
+        // number of isosurfaces drawn below the iso value
+        void setLevelCount(int count);
+        int getLevelCount();
+        // message shown at the top of the panel, empty hides it
+        void setStatus(const std::string &message);
 };
 
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+
+#include "rkcommon/tasking/parallel_for.h"
+
+#include "dataLoader.h"
+
+// Bits sorted per radix pass, 4 passes over the 32 bit keys
+const int RADIX_BITS = 8;
+const size_t RADIX_BUCKETS = size_t(1) << RADIX_BITS;
+
+// Maps a float to a key whose unsigned order is the float order. NaNs all
+// map to the largest key so they never fall below a threshold.
+uint32_t value_sort_key(float value)
+{
+    if (std::isnan(value)) {
+        return 0xffffffffu;
+    }
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
+
+float sort_key_value(uint32_t key)
+{
+    const uint32_t bits = key & 0x80000000u ? key & 0x7fffffffu : ~key;
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+struct SortKeysFn {
+    const Volume &volume;
+    uint32_t *keys;
+    uint64_t *order;
+
+    template <typename T>
+    void operator()(const T *voxels)
+    {
+        const size_t n = volume.n_voxels();
+        const size_t n_chunks = (n + SCAN_CHUNK_VOXELS - 1) / SCAN_CHUNK_VOXELS;
+        rkcommon::tasking::parallel_for(n_chunks, [&](size_t c) {
+            const size_t begin = c * SCAN_CHUNK_VOXELS;
+            const size_t end = std::min(n, begin + SCAN_CHUNK_VOXELS);
+            for (size_t i = begin; i < end; ++i) {
+                keys[i] = value_sort_key(volume.decode(float(voxels[i])));
+                order[i] = i;
+            }
+        });
+    }
+};
+
+// Stable LSD radix sort of keys with their voxel indices. Each pass counts
+// digits per chunk in parallel, offsets are laid out digit-major so every
+// chunk scatters into its own slots, also in parallel. Passes where all keys
+// share the digit (e.g. the high bytes of uint8 data) are skipped.
+// keys_tmp and order_tmp are scratch of the same size. A raised cancel flag
+// throws LoadCancelled before the next pass.
+void radix_sort_keys(uint32_t *keys,
+                     uint64_t *order,
+                     uint32_t *keys_tmp,
+                     uint64_t *order_tmp,
+                     size_t n,
+                     const std::atomic<bool> *cancel = nullptr)
+{
+    uint32_t *const keys_out = keys;
+    uint64_t *const order_out = order;
+    const size_t n_chunks = (n + SCAN_CHUNK_VOXELS - 1) / SCAN_CHUNK_VOXELS;
+    std::vector<size_t> counts(n_chunks * RADIX_BUCKETS);
+    for (int shift = 0; shift < 32; shift += RADIX_BITS) {
+        if (cancel && *cancel) {
+            throw LoadCancelled();
+        }
+        std::fill(counts.begin(), counts.end(), 0);
+        rkcommon::tasking::parallel_for(n_chunks, [&](size_t c) {
+            size_t *chunk_counts = &counts[c * RADIX_BUCKETS];
+            const size_t end = std::min(n, (c + 1) * SCAN_CHUNK_VOXELS);
+            for (size_t i = c * SCAN_CHUNK_VOXELS; i < end; ++i) {
+                ++chunk_counts[(keys[i] >> shift) & (RADIX_BUCKETS - 1)];
+            }
+        });
+
+        // exclusive prefix over (digit, chunk), turning counts into offsets
+        bool single_digit = false;
+        size_t offset = 0;
+        for (size_t d = 0; d < RADIX_BUCKETS; ++d) {
+            size_t digit_total = 0;
+            for (size_t c = 0; c < n_chunks; ++c) {
+                const size_t count = counts[c * RADIX_BUCKETS + d];
+                counts[c * RADIX_BUCKETS + d] = offset;
+                offset += count;
+                digit_total += count;
+            }
+            single_digit = single_digit || digit_total == n;
+        }
+        if (single_digit) {
+            continue;
+        }
+
+        rkcommon::tasking::parallel_for(n_chunks, [&](size_t c) {
+            size_t *chunk_offsets = &counts[c * RADIX_BUCKETS];
+            const size_t end = std::min(n, (c + 1) * SCAN_CHUNK_VOXELS);
+            for (size_t i = c * SCAN_CHUNK_VOXELS; i < end; ++i) {
+                const size_t dst = chunk_offsets[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+                keys_tmp[dst] = keys[i];
+                order_tmp[dst] = order[i];
+            }
+        });
+        std::swap(keys, keys_tmp);
+        std::swap(order, order_tmp);
+    }
+
+    // an odd number of passes ran, the sorted data is in the scratch buffers
+    if (keys != keys_out) {
+        rkcommon::tasking::parallel_for(n_chunks, [&](size_t c) {
+            const size_t begin = c * SCAN_CHUNK_VOXELS;
+            const size_t count = std::min(n, begin + SCAN_CHUNK_VOXELS) - begin;
+            std::memcpy(keys_out + begin, keys + begin, count * sizeof(uint32_t));
+            std::memcpy(order_out + begin, order + begin, count * sizeof(uint64_t));
+        });
+    }
+}
+
+// Voxel indices ordered by value, for threshold queries by binary search.
+// Costs 12 bytes per voxel while built, plus as much scratch during the sort.
+class SortedValueIndex {
+    std::shared_ptr<std::vector<uint32_t>> keys;
+    std::shared_ptr<std::vector<uint64_t>> order;
+
+public:
+    // Sorted voxel indices of a value interval
+    struct Range {
+        const uint64_t *begin;
+        const uint64_t *end;
+
+        size_t size() const
+        {
+            return end - begin;
+        }
+    };
+
+    SortedValueIndex() = default;
+
+    // Sorting can be abandoned from another thread through cancel
+    explicit SortedValueIndex(const Volume &volume, const std::atomic<bool> *cancel = nullptr)
+    {
+        auto start = std::chrono::steady_clock::now();
+        const size_t n = volume.n_voxels();
+        keys = allocate_buffer<uint32_t>(n, "value index");
+        order = allocate_buffer<uint64_t>(n, "value index");
+        SortKeysFn keys_fn{volume, keys->data(), order->data()};
+        dispatch_voxels(volume, keys_fn);
+
+        std::vector<uint32_t> keys_tmp(n);
+        std::vector<uint64_t> order_tmp(n);
+        radix_sort_keys(keys->data(), order->data(), keys_tmp.data(), order_tmp.data(), n, cancel);
+        print_throughput("value index", n * volume.voxel_size(), seconds_since(start));
+    }
+
+    bool empty() const
+    {
+        return !keys || keys->empty();
+    }
+
+    size_t size() const
+    {
+        return keys ? keys->size() : 0;
+    }
+
+    // Number of voxels with value < threshold
+    size_t count_below(float threshold) const
+    {
+        if (empty()) {
+            return 0;
+        }
+        return std::lower_bound(keys->begin(), keys->end(), value_sort_key(threshold)) - keys->begin();
+    }
+
+    // Voxels with lo <= value < hi, in value order
+    Range between(float lo, float hi) const
+    {
+        const size_t first = count_below(lo);
+        const size_t last = std::max(first, count_below(hi));
+        const uint64_t *indices = empty() ? nullptr : order->data();
+        return Range{indices + first, indices + last};
+    }
+
+    Range below(float threshold) const
+    {
+        const uint64_t *indices = empty() ? nullptr : order->data();
+        return Range{indices, indices + count_below(threshold)};
+    }
+
+    // Value of the voxel at a rank of the sorted order
+    float value_at(size_t rank) const
+    {
+        return sort_key_value((*keys)[rank]);
+    }
+};
+
+// Excursion set {value < threshold} kept up to date as the threshold moves.
+// Only the voxels between the old and new threshold are visited.
+class ExcursionSet {
+    SortedValueIndex index;
+    float threshold;
+    size_t count = 0;
+    double sum = 0.0;
+
+    double sum_ranks(size_t first, size_t last) const
+    {
+        double s = 0.0;
+        for (size_t r = first; r < last; ++r) {
+            s += index.value_at(r);
+        }
+        return s;
+    }
+
+public:
+    ExcursionSet(const SortedValueIndex &index, float threshold)
+        : index(index), threshold(threshold), count(index.count_below(threshold))
+    {
+        sum = sum_ranks(0, count);
+    }
+
+    void move_to(float next)
+    {
+        const size_t next_count = index.count_below(next);
+        if (next_count > count) {
+            sum += sum_ranks(count, next_count);
+        } else {
+            sum -= sum_ranks(next_count, count);
+        }
+        count = next_count;
+        threshold = next;
+    }
+
+    size_t voxels() const
+    {
+        return count;
+    }
+
+    // Fraction of the volume in the set
+    double fraction() const
+    {
+        return index.size() > 0 ? double(count) / index.size() : 0.0;
+    }
+
+    double mean() const
+    {
+        return count > 0 ? sum / count : 0.0;
+    }
+};
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rkcommon/math/vec.h"
+
+#include "volumeStats.h"
+
+using namespace rkcommon::math;
+
+// Sidecar cache (<volume>.cvvcache) of everything we would otherwise rescan
+// the volume for on every launch: stats, histogram and brick ranges. It is
+// keyed on the path, size, mtime and a hash of sampled blocks of the file,
+// plus the dims and voxel type the file is read as.
+
+const char VOLUME_CACHE_MAGIC[4] = {'C', 'V', 'V', 'S'};
+const uint32_t VOLUME_CACHE_VERSION = 3;
+
+// Blocks hashed by the content hash, spread evenly over the file
+const size_t CACHE_HASH_BLOCKS = 16;
+const size_t CACHE_HASH_BLOCK_BYTES = 64 * 1024;
+
+struct VolumeCacheKey {
+    std::string path;
+    uint64_t file_size = 0;
+    uint64_t mtime_ns = 0;
+    uint64_t content_hash = 0;
+    int32_t dims[3] = {0, 0, 0};
+    uint32_t voxel_type = 0;
+
+    bool operator==(const VolumeCacheKey &o) const
+    {
+        return path == o.path && file_size == o.file_size && mtime_ns == o.mtime_ns
+            && content_hash == o.content_hash && dims[0] == o.dims[0] && dims[1] == o.dims[1]
+            && dims[2] == o.dims[2] && voxel_type == o.voxel_type;
+    }
+};
+
+// 64-bit FNV-1a
+uint64_t fnv1a_hash(const uint8_t *data, size_t n, uint64_t hash = 14695981039346656037ull)
+{
+    for (size_t i = 0; i < n; ++i) {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+std::string volume_cache_path(const std::string &fname)
+{
+    return fname + ".cvvcache";
+}
+
+VolumeCacheKey make_volume_cache_key(const std::string &fname, const vec3i &dims, uint32_t voxel_type)
+{
+    VolumeCacheKey key;
+    key.path = fname;
+    key.dims[0] = dims.x;
+    key.dims[1] = dims.y;
+    key.dims[2] = dims.z;
+    key.voxel_type = voxel_type;
+
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return key;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        key.file_size = st.st_size;
+        key.mtime_ns = uint64_t(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec;
+    }
+
+    std::vector<uint8_t> block(CACHE_HASH_BLOCK_BYTES);
+    uint64_t hash = fnv1a_hash(nullptr, 0);
+    const uint64_t last = key.file_size > block.size() ? key.file_size - block.size() : 0;
+    for (size_t i = 0; i < CACHE_HASH_BLOCKS; ++i) {
+        const uint64_t offset = last * i / (CACHE_HASH_BLOCKS - 1);
+        const ssize_t n = pread(fd, block.data(), block.size(), offset);
+        if (n > 0) {
+            hash = fnv1a_hash(block.data(), n, hash);
+        }
+    }
+    key.content_hash = hash;
+    close(fd);
+    return key;
+}
+
+template <typename T>
+void write_pod(std::ostream &out, const T &value)
+{
+    out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T>
+void write_pod_vector(std::ostream &out, const std::vector<T> &values)
+{
+    write_pod(out, uint64_t(values.size()));
+    out.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(T));
+}
+
+template <typename T>
+bool read_pod(std::istream &in, T &value)
+{
+    return bool(in.read(reinterpret_cast<char *>(&value), sizeof(T)));
+}
+
+// Bytes between the read position and the end of the stream
+uint64_t bytes_left(std::istream &in)
+{
+    const std::streampos pos = in.tellg();
+    in.seekg(0, std::ios::end);
+    const std::streampos end = in.tellg();
+    in.seekg(pos);
+    return pos < 0 || end < pos ? 0 : uint64_t(end - pos);
+}
+
+template <typename T>
+bool read_pod_vector(std::istream &in, std::vector<T> &values)
+{
+    uint64_t n = 0;
+    // a corrupt count must not turn into a huge allocation
+    if (!read_pod(in, n) || n > bytes_left(in) / sizeof(T)) {
+        return false;
+    }
+    values.resize(n);
+    return bool(in.read(reinterpret_cast<char *>(values.data()), n * sizeof(T)));
+}
+
+void write_cache_key(std::ostream &out, const VolumeCacheKey &key)
+{
+    write_pod_vector(out, std::vector<char>(key.path.begin(), key.path.end()));
+    write_pod(out, key.file_size);
+    write_pod(out, key.mtime_ns);
+    write_pod(out, key.content_hash);
+    write_pod(out, key.dims);
+    write_pod(out, key.voxel_type);
+}
+
+bool read_cache_key(std::istream &in, VolumeCacheKey &key)
+{
+    std::vector<char> path;
+    if (!read_pod_vector(in, path)) {
+        return false;
+    }
+    key.path.assign(path.begin(), path.end());
+    return read_pod(in, key.file_size) && read_pod(in, key.mtime_ns) && read_pod(in, key.content_hash)
+        && read_pod(in, key.dims) && read_pod(in, key.voxel_type);
+}
+
+// Fills stats and bricks if a cache for exactly this key exists
+bool read_volume_cache(const std::string &fname,
+                       const VolumeCacheKey &key,
+                       VolumeStats &stats,
+                       BrickRanges &bricks)
+{
+    std::ifstream fin(volume_cache_path(fname).c_str(), std::ios::binary);
+    if (!fin) {
+        return false;
+    }
+    char magic[4];
+    uint32_t version = 0;
+    VolumeCacheKey cached;
+    if (!read_pod(fin, magic) || std::memcmp(magic, VOLUME_CACHE_MAGIC, 4) != 0
+        || !read_pod(fin, version) || version != VOLUME_CACHE_VERSION
+        || !read_cache_key(fin, cached) || !(cached == key)) {
+        return false;
+    }
+
+    uint64_t counts[3];
+    double moments[2];
+    if (!read_pod(fin, stats.range) || !read_pod(fin, moments) || !read_pod(fin, counts)
+        || !read_pod_vector(fin, stats.histogram) || !read_pod(fin, bricks.brick_size)
+        || !read_pod(fin, bricks.grid) || !read_pod_vector(fin, bricks.ranges)
+        || !read_pod_vector(fin, bricks.n_nan) || !read_pod_vector(fin, bricks.n_inf)
+        || bricks.ranges.size() != size_t(bricks.grid.x) * bricks.grid.y * bricks.grid.z
+        || !bricks.knows_non_finite()) {
+        return false;
+    }
+    stats.mean = moments[0];
+    stats.variance = moments[1];
+    stats.n_finite = counts[0];
+    stats.n_nan = counts[1];
+    stats.n_inf = counts[2];
+    return true;
+}
+
+// Best effort, a read-only data directory just means no cache. The cache is
+// written next to its final path and renamed over it, so a reader never
+// sees a half written file.
+void write_volume_cache(const std::string &fname,
+                        const VolumeCacheKey &key,
+                        const VolumeStats &stats,
+                        const BrickRanges &bricks)
+{
+    const std::string cache_path = volume_cache_path(fname);
+    const std::string tmp_path = cache_path + ".tmp";
+    std::ofstream fout(tmp_path.c_str(), std::ios::binary);
+    if (!fout) {
+        std::cout << "Cannot write volume cache " << cache_path << std::endl;
+        return;
+    }
+    fout.write(VOLUME_CACHE_MAGIC, 4);
+    write_pod(fout, VOLUME_CACHE_VERSION);
+    write_cache_key(fout, key);
+
+    const uint64_t counts[3] = {stats.n_finite, stats.n_nan, stats.n_inf};
+    const double moments[2] = {stats.mean, stats.variance};
+    write_pod(fout, stats.range);
+    write_pod(fout, moments);
+    write_pod(fout, counts);
+    write_pod_vector(fout, stats.histogram);
+    write_pod(fout, bricks.brick_size);
+    write_pod(fout, bricks.grid);
+    write_pod_vector(fout, bricks.ranges);
+    write_pod_vector(fout, bricks.n_nan);
+    write_pod_vector(fout, bricks.n_inf);
+    fout.close();
+    if (!fout || std::rename(tmp_path.c_str(), cache_path.c_str()) != 0) {
+        std::cout << "Cannot write volume cache " << cache_path << std::endl;
+        std::remove(tmp_path.c_str());
+    }
+}
@@ -0,0 +1,330 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include "rkcommon/math/vec.h"
+
+#include "json.hpp"
+#include "dataLoader.h"
+
+using namespace rkcommon::math;
+
+// Header readers for self-describing volume files. Each one only parses the
+// header and returns a RawVolumeLayout, the voxels are then read or mapped by
+// load_raw_volume like any raw file.
+
+bool host_is_big_endian()
+{
+    const uint16_t probe = 1;
+    return *reinterpret_cast<const uint8_t *>(&probe) == 0;
+}
+
+// numpy dtype strings such as '<f8', '|u1', '>u2'
+void parse_npy_dtype(const std::string &descr, RawVolumeLayout &layout)
+{
+    if (descr.size() != 3) {
+        throw std::runtime_error("Unsupported npy dtype " + descr);
+    }
+    const std::string kind = descr.substr(1);
+    if (kind == "u1") {
+        layout.voxel_type = "uint8";
+    } else if (kind == "u2") {
+        layout.voxel_type = "uint16";
+    } else if (kind == "f4") {
+        layout.voxel_type = "float32";
+    } else if (kind == "f8") {
+        layout.voxel_type = "float64";
+    } else {
+        throw std::runtime_error("Unsupported npy dtype " + descr);
+    }
+    const bool big = descr[0] == '>' || (descr[0] == '=' && host_is_big_endian());
+    layout.big_endian = big != host_is_big_endian();
+}
+
+// Value of 'key': ... in the python dict literal of an npy header
+std::string npy_header_field(const std::string &header, const std::string &key)
+{
+    const size_t k = header.find("'" + key + "'");
+    if (k == std::string::npos) {
+        throw std::runtime_error("npy header has no " + key);
+    }
+    const std::runtime_error no_value("npy header has no value for " + key);
+    size_t begin = header.find(':', k);
+    if (begin == std::string::npos) {
+        throw no_value;
+    }
+    ++begin;
+    while (begin < header.size() && header[begin] == ' ') {
+        ++begin;
+    }
+    if (begin >= header.size()) {
+        throw no_value;
+    }
+    size_t end = begin;
+    if (header[begin] == '(') {
+        end = header.find(')', begin);
+        end = end == std::string::npos ? end : end + 1;
+    } else if (header[begin] == '\'') {
+        end = header.find('\'', begin + 1);
+        end = end == std::string::npos ? end : end + 1;
+    } else {
+        end = header.find_first_of(",}", begin);
+    }
+    if (end == std::string::npos || end == begin) {
+        throw no_value;
+    }
+    return header.substr(begin, end - begin);
+}
+
+RawVolumeLayout read_npy_header(const std::string &fname)
+{
+    std::ifstream fin(fname.c_str(), std::ios::binary);
+    char magic[8];
+    if (!fin.read(magic, 8) || std::memcmp(magic, "\x93NUMPY", 6) != 0) {
+        throw std::runtime_error(fname + " is not an npy file");
+    }
+    const int major = magic[6];
+    uint32_t header_len = 0;
+    uint8_t len_bytes[4] = {0, 0, 0, 0};
+    const int len_size = major == 1 ? 2 : 4;
+    fin.read(reinterpret_cast<char *>(len_bytes), len_size);
+    for (int i = len_size - 1; i >= 0; --i) {
+        header_len = (header_len << 8) | len_bytes[i];
+    }
+    std::string header(header_len, ' ');
+    if (!fin.read(&header[0], header_len)) {
+        throw std::runtime_error("Truncated npy header in " + fname);
+    }
+
+    RawVolumeLayout layout;
+    layout.fname = fname;
+    layout.header_bytes = 8 + len_size + header_len;
+
+    const std::string descr = npy_header_field(header, "descr");
+    if (descr.size() < 2 || descr[0] != '\'') {
+        throw std::runtime_error("Unsupported npy dtype " + descr);
+    }
+    parse_npy_dtype(descr.substr(1, descr.size() - 2), layout);
+
+    // shape is slowest axis first in C order, fastest first in Fortran order
+    std::vector<int> shape;
+    std::stringstream shape_stream(npy_header_field(header, "shape"));
+    std::string item;
+    while (std::getline(shape_stream, item, ',')) {
+        item.erase(std::remove_if(item.begin(), item.end(), [](char c) { return c == '(' || c == ')' || c == ' '; }),
+                   item.end());
+        if (!item.empty()) {
+            shape.push_back(std::stoi(item));
+        }
+    }
+    if (shape.empty() || shape.size() > 3) {
+        throw std::runtime_error("npy array in " + fname + " is not a volume");
+    }
+    for (int n : shape) {
+        if (n <= 0) {
+            throw std::runtime_error("npy array in " + fname + " has an empty or negative dimension");
+        }
+    }
+    if (npy_header_field(header, "fortran_order") != "True") {
+        std::reverse(shape.begin(), shape.end());
+    }
+    shape.resize(3, 1);
+    layout.dims = vec3i(shape[0], shape[1], shape[2]);
+    return layout;
+}
+
+std::string trim_whitespace(const std::string &s)
+{
+    const size_t begin = s.find_first_not_of(" \t\r");
+    const size_t end = s.find_last_not_of(" \t\r");
+    return begin == std::string::npos ? "" : s.substr(begin, end - begin + 1);
+}
+
+// Numbers of an NRRD vector field such as "(1,0,0) (0,1,0)" or "0.5 0.5 0.5"
+std::vector<float> parse_nrrd_numbers(const std::string &value)
+{
+    std::string cleaned = value;
+    for (auto &c : cleaned) {
+        if (c == '(' || c == ')' || c == ',') {
+            c = ' ';
+        }
+    }
+    std::vector<float> numbers;
+    std::stringstream stream(cleaned);
+    std::string token;
+    while (stream >> token) {
+        numbers.push_back(token == "nan" || token == "none" ? NAN : std::stof(token));
+    }
+    return numbers;
+}
+
+// Exactly the three per-axis numbers of a NRRD field
+std::vector<float> parse_nrrd_axes(const std::string &value, const std::string &key, const std::string &fname)
+{
+    const std::vector<float> numbers = parse_nrrd_numbers(value);
+    if (numbers.size() != 3) {
+        throw std::runtime_error("NRRD " + fname + " has " + std::to_string(numbers.size()) + " values for " + key
+                                 + ", expected 3");
+    }
+    return numbers;
+}
+
+RawVolumeLayout read_nrrd_header(const std::string &fname)
+{
+    std::ifstream fin(fname.c_str(), std::ios::binary);
+    std::string line;
+    if (!std::getline(fin, line) || line.compare(0, 4, "NRRD") != 0) {
+        throw std::runtime_error(fname + " is not an NRRD file");
+    }
+
+    RawVolumeLayout layout;
+    layout.fname = fname;
+    std::string data_file;
+    size_t byte_skip = 0;
+    while (std::getline(fin, line)) {
+        line = trim_whitespace(line);
+        if (line.empty()) {
+            break;
+        }
+        if (line[0] == '#') {
+            continue;
+        }
+        const size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        const std::string key = trim_whitespace(line.substr(0, colon));
+        const std::string value = trim_whitespace(line.substr(line[colon + 1] == '=' ? colon + 2 : colon + 1));
+
+        if (key == "type") {
+            if (value == "uchar" || value == "unsigned char" || value == "uint8" || value == "uint8_t") {
+                layout.voxel_type = "uint8";
+            } else if (value == "ushort" || value == "unsigned short" || value == "uint16"
+                       || value == "uint16_t" || value == "unsigned short int") {
+                layout.voxel_type = "uint16";
+            } else if (value == "float") {
+                layout.voxel_type = "float32";
+            } else if (value == "double") {
+                layout.voxel_type = "float64";
+            } else {
+                throw std::runtime_error("Unsupported NRRD type " + value);
+            }
+        } else if (key == "dimension") {
+            if (std::stoi(value) != 3) {
+                throw std::runtime_error("NRRD " + fname + " is not a 3D volume");
+            }
+        } else if (key == "sizes") {
+            const std::vector<float> sizes = parse_nrrd_axes(value, key, fname);
+            layout.dims = vec3i(int(sizes[0]), int(sizes[1]), int(sizes[2]));
+        } else if (key == "endian") {
+            layout.big_endian = (value == "big") != host_is_big_endian();
+        } else if (key == "encoding") {
+            if (value != "raw") {
+                throw std::runtime_error("Only raw NRRD encoding is supported, " + fname + " is " + value);
+            }
+        } else if (key == "spacings") {
+            const std::vector<float> spacings = parse_nrrd_axes(value, key, fname);
+            layout.spacing = vec3f(spacings[0], spacings[1], spacings[2]);
+        } else if (key == "space directions") {
+            // spacing is the length of each axis direction
+            const std::vector<float> d = parse_nrrd_numbers(value);
+            if (d.size() == 9) {
+                layout.spacing = vec3f(std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]),
+                                       std::sqrt(d[3] * d[3] + d[4] * d[4] + d[5] * d[5]),
+                                       std::sqrt(d[6] * d[6] + d[7] * d[7] + d[8] * d[8]));
+            }
+        } else if (key == "space origin") {
+            const std::vector<float> o = parse_nrrd_axes(value, key, fname);
+            layout.origin = vec3f(o[0], o[1], o[2]);
+        } else if (key == "byte skip") {
+            byte_skip = std::stoul(value);
+        } else if (key == "data file" || key == "datafile") {
+            data_file = value;
+        }
+    }
+
+    if (data_file.empty()) {
+        // attached header, the voxels follow the blank line
+        layout.header_bytes = size_t(fin.tellg()) + byte_skip;
+    } else {
+        // detached header, data file paths are relative to the header
+        const size_t slash = fname.rfind('/');
+        layout.fname = data_file[0] == '/' || slash == std::string::npos
+            ? data_file
+            : fname.substr(0, slash + 1) + data_file;
+        layout.header_bytes = byte_skip;
+    }
+    if (layout.voxel_type.empty() || layout.dims.x == 0) {
+        throw std::runtime_error("NRRD header " + fname + " is missing type or sizes");
+    }
+    return layout;
+}
+
+// JSON sidecar describing a raw file:
+//   {"file": "density.raw", "dims": [x, y, z], "dtype": "float64",
+//    "endian": "little", "spacing": [..], "origin": [..], "offset": 0}
+// "file" defaults to the sidecar name without its .json extension.
+RawVolumeLayout read_json_sidecar(const std::string &fname)
+{
+    std::ifstream fin(fname.c_str());
+    if (!fin) {
+        throw std::runtime_error("Cannot open sidecar " + fname);
+    }
+    const nlohmann::json desc = nlohmann::json::parse(fin);
+
+    RawVolumeLayout layout;
+    const std::string raw_name = fname.substr(0, fname.rfind('.'));
+    layout.fname = raw_name;
+    if (desc.contains("file")) {
+        const std::string file = desc["file"];
+        const size_t slash = fname.rfind('/');
+        layout.fname = file[0] == '/' || slash == std::string::npos ? file : fname.substr(0, slash + 1) + file;
+    }
+    const auto &dims = desc.at("dims");
+    layout.dims = vec3i(dims.at(0).get<int>(), dims.at(1).get<int>(), dims.at(2).get<int>());
+    layout.voxel_type = desc.at("dtype").get<std::string>();
+    layout.header_bytes = desc.value("offset", size_t(0));
+    layout.big_endian = (desc.value("endian", std::string("little")) == "big") != host_is_big_endian();
+    if (desc.contains("spacing")) {
+        const auto &spacing = desc["spacing"];
+        layout.spacing = vec3f(spacing.at(0).get<float>(), spacing.at(1).get<float>(), spacing.at(2).get<float>());
+    }
+    if (desc.contains("origin")) {
+        const auto &origin = desc["origin"];
+        layout.origin = vec3f(origin.at(0).get<float>(), origin.at(1).get<float>(), origin.at(2).get<float>());
+    }
+    return layout;
+}
+
+bool file_exists(const std::string &fname)
+{
+    return std::ifstream(fname.c_str()).good();
+}
+
+// Pick the reader from the file extension. Plain raw files use -dims/-dtype,
+// or a <file>.json sidecar next to them when -dims is not given.
+RawVolumeLayout describe_volume_file(const std::string &fname,
+                                     const std::string &extension,
+                                     const vec3i &dims,
+                                     const std::string &voxel_type)
+{
+    if (extension == "npy") {
+        return read_npy_header(fname);
+    } else if (extension == "nrrd" || extension == "nhdr") {
+        return read_nrrd_header(fname);
+    } else if (extension == "json") {
+        return read_json_sidecar(fname);
+    }
+    if (dims.x == 0 && file_exists(fname + ".json")) {
+        return read_json_sidecar(fname + ".json");
+    }
+    return make_raw_layout(fname, dims, voxel_type);
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <memory>
+#include <algorithm>
+
+#include "rkcommon/math/vec.h"
+#include "rkcommon/tasking/parallel_for.h"
+
+#include "ArcballCamera.h"
+#include "dataLoader.h"
+
+using namespace rkcommon::math;
+
+enum class DownsampleFilter { BOX, MAX };
+
+// Levels stop once the coarsest axis would drop below this many voxels
+const int PYRAMID_MIN_DIM = 8;
+
+struct DownsampleFn {
+    const Volume &src;
+    const vec3i dims;
+    DownsampleFilter filter;
+    void *out;
+
+    template <typename T>
+    void operator()(const T *voxels)
+    {
+        T *dst = static_cast<T *>(out);
+        const vec3i src_dims = src.dims;
+        rkcommon::tasking::parallel_for(dims.z, [&](int z) {
+            for (int y = 0; y < dims.y; ++y) {
+                for (int x = 0; x < dims.x; ++x) {
+                    // 2x2x2 footprint, clamped at odd edges
+                    double sum = 0.0;
+                    T hi = voxels[(size_t(2 * z) * src_dims.y + 2 * y) * src_dims.x + 2 * x];
+                    for (int dz = 0; dz < 2; ++dz) {
+                        const size_t sz = std::min(2 * z + dz, src_dims.z - 1);
+                        for (int dy = 0; dy < 2; ++dy) {
+                            const size_t sy = std::min(2 * y + dy, src_dims.y - 1);
+                            for (int dx = 0; dx < 2; ++dx) {
+                                const size_t sx = std::min(2 * x + dx, src_dims.x - 1);
+                                const T v = voxels[(sz * src_dims.y + sy) * src_dims.x + sx];
+                                sum += v;
+                                hi = std::max(hi, v);
+                            }
+                        }
+                    }
+                    T result = hi;
+                    if (filter == DownsampleFilter::BOX) {
+                        result = std::numeric_limits<T>::is_integer ? T(std::lround(sum / 8.0)) : T(sum / 8.0);
+                    }
+                    dst[(size_t(z) * dims.y + y) * dims.x + x] = result;
+                }
+            }
+        });
+    }
+};
+
+// Half resolution copy of a volume in its native type, covering the same extent
+Volume downsample_volume(const Volume &volume, DownsampleFilter filter)
+{
+    Volume half;
+    half.dims = vec3i((volume.dims.x + 1) / 2, (volume.dims.y + 1) / 2, (volume.dims.z + 1) / 2);
+    half.spacing = volume.spacing * 2.f;
+    half.origin = volume.origin;
+    half.voxel_type = volume.voxel_type;
+    half.value_offset = volume.value_offset;
+    half.value_scale = volume.value_scale;
+    half.range = volume.range;
+    half.stats = volume.stats;
+
+    auto voxels = allocate_buffer<uint8_t>(half.n_voxels() * half.voxel_size(), "pyramid");
+    half.voxel_data = std::shared_ptr<const void>(voxels, voxels->data());
+    DownsampleFn downsample_fn{volume, half.dims, filter, voxels->data()};
+    dispatch_voxels(volume, downsample_fn);
+    return half;
+}
+
+// Mip pyramid, levels[0] is the full resolution volume
+struct VolumePyramid {
+    std::vector<Volume> levels;
+};
+
+VolumePyramid build_volume_pyramid(const Volume &volume, DownsampleFilter filter)
+{
+    VolumePyramid pyramid;
+    pyramid.levels.push_back(volume);
+    while (reduce_min(pyramid.levels.back().dims) >= 2 * PYRAMID_MIN_DIM) {
+        pyramid.levels.push_back(downsample_volume(pyramid.levels.back(), filter));
+    }
+    return pyramid;
+}
+
+// Pick the level whose voxels project to about one pixel. While the camera
+// moves we never render level 0, once it stops the full resolution returns.
+// Grid spacing matches updateStructuredVolume (2 * spacing per voxel).
+int select_pyramid_level(const VolumePyramid &pyramid,
+                         const ArcballCamera &camera,
+                         const vec2i &img_size,
+                         bool interacting,
+                         float fovy_degrees = 60.f)
+{
+    const int coarsest = int(pyramid.levels.size()) - 1;
+    if (!interacting || coarsest == 0) {
+        return 0;
+    }
+    const float distance = std::max(length(camera.eyePos() - camera.center()), 1e-3f);
+    const float pixel_size = 2.f * distance * std::tan(fovy_degrees * float(M_PI) / 360.f) / img_size.y;
+    const float voxel_size = 2.f * reduce_max(pyramid.levels[0].spacing);
+    // each level doubles the voxel size
+    const int level = int(std::floor(std::log2(pixel_size / voxel_size)));
+    return std::min(std::max(level, 1), coarsest);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+#include "rkcommon/math/vec.h"
+#include "rkcommon/tasking/parallel_for.h"
+
+#include "dataLoader.h"
+
+using namespace rkcommon::math;
+
+// Lossy storage of float densities as uint8/uint16 codes with an affine
+// value = offset + scale * code. Codes are rounded to nearest, so the error
+// is at most scale / 2. Non-finite values clamp to the ends of the range.
+
+float quantized_max(VoxelType voxel_type)
+{
+    switch (voxel_type) {
+    case VoxelType::UINT8:
+        return 255.f;
+    case VoxelType::UINT16:
+        return 65535.f;
+    default:
+        throw std::runtime_error("Quantized volumes are stored as uint8 or uint16");
+    }
+}
+
+// Scale mapping [lo, hi] onto the codes of voxel_type
+float quantized_scale(float lo, float hi, VoxelType voxel_type)
+{
+    return hi > lo ? (hi - lo) / quantized_max(voxel_type) : 1.f;
+}
+
+template <typename Q>
+Q quantize_value(float value, float offset, float scale)
+{
+    const float code = std::round((value - offset) / scale);
+    if (!(code > 0.f)) {
+        return 0;
+    }
+    return code >= float(std::numeric_limits<Q>::max()) ? std::numeric_limits<Q>::max() : Q(code);
+}
+
+// Codes of n stored voxels, decoded with (in_offset, in_scale) first
+template <typename T, typename Q>
+void quantize_voxels(const T *in, size_t n, float in_offset, float in_scale, float offset, float scale, Q *out)
+{
+    const size_t n_chunks = (n + SCAN_CHUNK_VOXELS - 1) / SCAN_CHUNK_VOXELS;
+    rkcommon::tasking::parallel_for(n_chunks, [&](size_t c) {
+        const size_t begin = c * SCAN_CHUNK_VOXELS;
+        const size_t end = std::min(n, begin + SCAN_CHUNK_VOXELS);
+        for (size_t i = begin; i < end; ++i) {
+            out[i] = quantize_value<Q>(in_offset + in_scale * float(in[i]), offset, scale);
+        }
+    });
+}
+
+struct QuantizeFn {
+    const Volume &volume;
+    VoxelType target;
+    float offset;
+    float scale;
+    void *out;
+
+    template <typename T>
+    void operator()(const T *voxels)
+    {
+        const size_t n = volume.n_voxels();
+        if (target == VoxelType::UINT8) {
+            quantize_voxels(
+                voxels, n, volume.value_offset, volume.value_scale, offset, scale, static_cast<uint8_t *>(out));
+        } else {
+            quantize_voxels(
+                voxels, n, volume.value_offset, volume.value_scale, offset, scale, static_cast<uint16_t *>(out));
+        }
+    }
+};
+
+// Quantize a whole volume with one affine over its range. Stats, range and
+// brick ranges carry over unchanged since they are kept in values.
+Volume quantize_volume(const Volume &volume, VoxelType target)
+{
+    Volume quantized = volume;
+    quantized.voxel_type = target;
+    quantized.value_offset = volume.range.x;
+    quantized.value_scale = quantized_scale(volume.range.x, volume.range.y, target);
+
+    auto start = std::chrono::steady_clock::now();
+    auto codes = allocate_buffer<uint8_t>(quantized.n_voxels() * quantized.voxel_size(), "quantized");
+    quantized.voxel_data = std::shared_ptr<const void>(codes, codes->data());
+    QuantizeFn quantize_fn{volume, target, quantized.value_offset, quantized.value_scale, codes->data()};
+    dispatch_voxels(volume, quantize_fn);
+    print_throughput("quantize", volume.n_voxels() * volume.voxel_size(), seconds_since(start));
+
+    const float max_error = quantized.value_scale / 2.f;
+    std::cout << "quantized to " << quantized.voxel_size() * 8 << " bits, max error " << max_error << " ("
+              << 100.f * max_error / std::max(volume.range.y - volume.range.x, 1e-30f) << "% of range)"
+              << std::endl;
+    return quantized;
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <utility>
+#include <stdexcept>
+
+#include "rkcommon/tasking/parallel_for.h"
+
+#include "dataLoader.h"
+#include "valueIndex.h"
+#include "persistence.h"
+
+// Topological simplification of the sublevel sets: every minimum-saddle
+// pair with persistence below a threshold is cancelled by raising the voids
+// of those branches to their saddle value. What remains are the minima of
+// the significant voids, so the field has fewer and larger components.
+
+// Value each branch's voxels are raised to, -inf for the branches that
+// keep their values. The tree is walked top-down one level at a time, every
+// level in parallel: a branch inside a cancelled void takes the value of
+// the outermost one, else its own saddle if it is cancelled itself.
+std::vector<float> flatten_values(const MergeTree &tree, float threshold)
+{
+    const float KEEP = -std::numeric_limits<float>::infinity();
+    std::vector<float> flatten(tree.size(), KEEP);
+    std::vector<uint32_t> level;
+    for (uint32_t b = 0; b < tree.size(); ++b) {
+        if (tree.parent[b] == NO_BRANCH) {
+            level.push_back(b);
+        }
+    }
+    std::vector<uint32_t> next;
+    std::vector<uint64_t> next_offsets;
+    while (!level.empty()) {
+        next_offsets.assign(level.size() + 1, 0);
+        for (size_t i = 0; i < level.size(); ++i) {
+            next_offsets[i + 1] =
+                next_offsets[i] + tree.child_offsets[level[i] + 1] - tree.child_offsets[level[i]];
+        }
+        next.resize(next_offsets.back());
+        rkcommon::tasking::parallel_for(level.size(), [&](size_t i) {
+            const uint32_t b = level[i];
+            uint64_t out = next_offsets[i];
+            for (uint64_t c = tree.child_offsets[b]; c < tree.child_offsets[b + 1]; ++c) {
+                const uint32_t child = tree.children[c];
+                const bool cancelled = tree.death[child] - tree.birth[child] < threshold;
+                // children die below their parent's saddle, an outer void wins
+                flatten[child] = flatten[b] != KEEP ? flatten[b] : cancelled ? tree.death[child] : KEEP;
+                next[out++] = child;
+            }
+        });
+        level.swap(next);
+    }
+    return flatten;
+}
+
+struct SimplifyFn {
+    const Volume &volume;
+    const std::vector<uint32_t> &labels;
+    const std::vector<float> &flatten;
+    float *out;
+
+    template <typename T>
+    void operator()(const T *voxels)
+    {
+        const size_t n = volume.n_voxels();
+        rkcommon::tasking::parallel_for((n + SCAN_CHUNK_VOXELS - 1) / SCAN_CHUNK_VOXELS, [&](size_t c) {
+            const size_t end = std::min(n, (c + 1) * SCAN_CHUNK_VOXELS);
+            for (size_t i = c * SCAN_CHUNK_VOXELS; i < end; ++i) {
+                const float value = volume.decode(float(voxels[i]));
+                // NaN voxels have no branch and stay NaN
+                out[i] = labels[i] == NO_BRANCH ? value : std::max(value, flatten[labels[i]]);
+            }
+        });
+    }
+};
+
+// Flattened voids are plateaus at their saddle values, and the volume may
+// have plateaus of its own. With ties broken by index the first voxel of a
+// plateau to enter starts a branch of zero persistence, so every cancelled
+// void would come back as a branch. Instead each plateau voxel is raised one
+// float step per voxel on its shortest path to an exit, a voxel of the
+// plateau with a lower neighbour, and a plateau without an exit drains into
+// its first voxel. Every voxel then has a neighbour entering just before it
+// and the only minima left are those of the pairs kept. The walks are
+// breadth-first, from all the exits at once.
+void drain_plateaus(const vec3i &dims, float *values)
+{
+    const size_t n = size_t(dims.x) * dims.y * dims.z;
+    const uint64_t plane = uint64_t(dims.x) * dims.y;
+    const uint32_t max_key = value_sort_key(std::numeric_limits<float>::infinity());
+    auto neighbors_of = [&](uint64_t v, uint64_t *neighbors) {
+        const int x = int(v % dims.x);
+        const int y = int((v / dims.x) % dims.y);
+        const int z = int(v / plane);
+        neighbors[0] = x > 0 ? v - 1 : NO_VOXEL;
+        neighbors[1] = x + 1 < dims.x ? v + 1 : NO_VOXEL;
+        neighbors[2] = y > 0 ? v - dims.x : NO_VOXEL;
+        neighbors[3] = y + 1 < dims.y ? v + dims.x : NO_VOXEL;
+        neighbors[4] = z > 0 ? v - plane : NO_VOXEL;
+        neighbors[5] = z + 1 < dims.z ? v + plane : NO_VOXEL;
+    };
+
+    // plateau voxels not reached yet, and the exits
+    const uint8_t FLAT = 1, EXIT = 2, REACHED = 3;
+    std::vector<uint8_t> state(n, 0);
+    rkcommon::tasking::parallel_for((n + SCAN_CHUNK_VOXELS - 1) / SCAN_CHUNK_VOXELS, [&](size_t c) {
+        const size_t end = std::min(n, (c + 1) * SCAN_CHUNK_VOXELS);
+        uint64_t neighbors[6];
+        for (size_t v = c * SCAN_CHUNK_VOXELS; v < end; ++v) {
+            bool flat = false, lower = false;
+            neighbors_of(v, neighbors);
+            for (uint64_t w : neighbors) {
+                // NaN compares false and never joins a plateau
+                flat |= w != NO_VOXEL && values[w] == values[v];
+                lower |= w != NO_VOXEL && values[w] < values[v];
+            }
+            state[v] = !flat ? 0 : lower ? EXIT : FLAT;
+        }
+    });
+
+    // frontier voxels with the value of their plateau
+    std::vector<std::pair<uint64_t, float>> frontier, next;
+    auto drain = [&]() {
+        uint64_t neighbors[6];
+        while (!frontier.empty()) {
+            next.clear();
+            for (const auto &f : frontier) {
+                const float raised = sort_key_value(std::min(value_sort_key(values[f.first]) + 1, max_key));
+                neighbors_of(f.first, neighbors);
+                for (uint64_t w : neighbors) {
+                    if (w != NO_VOXEL && state[w] == FLAT && values[w] == f.second) {
+                        state[w] = REACHED;
+                        values[w] = raised;
+                        next.push_back(std::make_pair(w, f.second));
+                    }
+                }
+            }
+            frontier.swap(next);
+        }
+    };
+    for (uint64_t v = 0; v < n; ++v) {
+        if (state[v] == EXIT) {
+            frontier.push_back(std::make_pair(v, values[v]));
+        }
+    }
+    drain();
+    // what is left are plateaus without an exit, v is the first voxel of one
+    for (uint64_t v = 0; v < n; ++v) {
+        if (state[v] == FLAT) {
+            state[v] = REACHED;
+            frontier.push_back(std::make_pair(v, values[v]));
+            drain();
+        }
+    }
+}
+
+// Float32 copy of volume with every pair of persistence < threshold
+// cancelled and its plateaus drained. The tree must have labels and come from this volume. A raised
+// cancel flag throws LoadCancelled between the passes.
+Volume simplify_volume(const Volume &volume,
+                       const MergeTree &tree,
+                       float threshold,
+                       const std::atomic<bool> *cancel = nullptr)
+{
+    if (!tree.has_labels() || tree.labels->size() != volume.n_voxels()) {
+        throw std::runtime_error("Simplification needs the labelled merge tree of the volume");
+    }
+    auto start = std::chrono::steady_clock::now();
+    const std::vector<float> flatten = flatten_values(tree, threshold);
+    size_t cancelled = 0;
+    for (float value : flatten) {
+        cancelled += value != -std::numeric_limits<float>::infinity();
+    }
+
+    Volume simplified = volume;
+    simplified.voxel_type = VoxelType::FLOAT32;
+    simplified.value_scale = 1.f;
+    simplified.value_offset = 0.f;
+    auto values = allocate_buffer<float>(volume.n_voxels(), "simplified");
+    simplified.voxel_data = std::shared_ptr<const void>(values, values->data());
+    SimplifyFn simplify_fn{volume, *tree.labels, flatten, values->data()};
+    dispatch_voxels(volume, simplify_fn);
+    check_cancelled(cancel);
+    drain_plateaus(volume.dims, values->data());
+    check_cancelled(cancel);
+    print_throughput("simplify", volume.n_voxels() * volume.voxel_size(), seconds_since(start));
+    std::cout << "cancelled " << cancelled << " of " << tree.size() << " branches below persistence " << threshold
+              << std::endl;
+
+    VolumeStatsFn stats_fn{simplified.n_voxels(), nullptr, VolumeStats()};
+    dispatch_voxels(simplified, stats_fn);
+    simplified.stats = stats_fn.stats;
+    check_cancelled(cancel);
+    VolumeSummaryFn summary_fn{simplified, simplified.stats, BrickRanges()};
+    dispatch_voxels(simplified, summary_fn);
+    simplified.brick_ranges = std::make_shared<BrickRanges>(summary_fn.bricks);
+    simplified.range = simplified.stats.range;
+    return simplified;
+}
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "rkcommon/math/vec.h"
+#include "rkcommon/tasking/parallel_for.h"
+
+using namespace rkcommon::math;
+
+struct VolumeStats {
+    vec2f range{0.f};
+    double mean = 0.0;
+    double variance = 0.0;
+    size_t n_finite = 0;
+    size_t n_nan = 0;
+    size_t n_inf = 0;
+    // counts of finite voxels in equal bins over range
+    std::vector<uint64_t> histogram;
+};
+
+// Brick size of the min/max summary kept with a loaded volume
+const int BRICK_RANGE_SIZE = 32;
+
+// Per-brick value range of a volume on a regular brick grid. The ranges
+// only cover the finite voxels, the others are counted per brick; empty
+// counts mean they are not known.
+struct BrickRanges {
+    int brick_size = BRICK_RANGE_SIZE;
+    vec3i grid{0};
+    std::vector<vec2f> ranges;
+    std::vector<uint32_t> n_nan;
+    std::vector<uint32_t> n_inf;
+
+    bool knows_non_finite() const
+    {
+        return n_nan.size() == ranges.size() && n_inf.size() == ranges.size();
+    }
+};
+
+// Partial result of scanning one chunk of voxels
+struct ScanChunk {
+    float lo = std::numeric_limits<float>::infinity();
+    float hi = -std::numeric_limits<float>::infinity();
+    size_t n_finite = 0;
+    size_t n_nan = 0;
+    size_t n_inf = 0;
+    double mean = 0.0;
+    double m2 = 0.0;
+};
+
+// Voxels per task of the parallel scan, big enough to amortize scheduling
+const size_t SCAN_CHUNK_VOXELS = size_t(1) << 20;
+
+// Independent accumulators per lane so the compiler can vectorize the scan
+// without reassociating floating point math
+const size_t SCAN_LANES = 8;
+
+// Single pass over n voxels: optionally writes them out as float, and gathers
+// min/max, mean, M2 and NaN/Inf counts. Sums are shifted by the first value
+// to keep the variance stable when the mean is large.
+template <typename T, bool WRITE>
+ScanChunk scan_voxels(const T *in, float *out, size_t n)
+{
+    ScanChunk chunk;
+    if (n == 0) {
+        return chunk;
+    }
+    const bool integral = std::numeric_limits<T>::is_integer;
+    const float shift_value = float(in[0]);
+    const double shift = std::isfinite(shift_value) ? shift_value : 0.0;
+
+    float lo[SCAN_LANES], hi[SCAN_LANES];
+    double sum[SCAN_LANES], sum2[SCAN_LANES];
+    size_t n_bad[SCAN_LANES], n_nan[SCAN_LANES];
+    for (size_t l = 0; l < SCAN_LANES; ++l) {
+        lo[l] = chunk.lo;
+        hi[l] = chunk.hi;
+        sum[l] = sum2[l] = 0.0;
+        n_bad[l] = n_nan[l] = 0;
+    }
+
+    auto accumulate = [&](size_t i, size_t l) {
+        const float x = float(in[i]);
+        if (WRITE) {
+            out[i] = x;
+        }
+        const bool finite = integral || std::isfinite(x);
+        lo[l] = finite && x < lo[l] ? x : lo[l];
+        hi[l] = finite && x > hi[l] ? x : hi[l];
+        const double d = finite ? x - shift : 0.0;
+        sum[l] += d;
+        sum2[l] += d * d;
+        n_bad[l] += !finite;
+        n_nan[l] += x != x;
+    };
+
+    size_t i = 0;
+    for (; i + SCAN_LANES <= n; i += SCAN_LANES) {
+        for (size_t l = 0; l < SCAN_LANES; ++l) {
+            accumulate(i + l, l);
+        }
+    }
+    for (size_t l = 0; i + l < n; ++l) {
+        accumulate(i + l, l);
+    }
+
+    double total_sum = 0.0;
+    double total_sum2 = 0.0;
+    for (size_t l = 0; l < SCAN_LANES; ++l) {
+        chunk.lo = std::min(chunk.lo, lo[l]);
+        chunk.hi = std::max(chunk.hi, hi[l]);
+        total_sum += sum[l];
+        total_sum2 += sum2[l];
+        chunk.n_nan += n_nan[l];
+        chunk.n_inf += n_bad[l] - n_nan[l];
+    }
+    chunk.n_finite = n - chunk.n_nan - chunk.n_inf;
+    if (chunk.n_finite > 0) {
+        chunk.mean = shift + total_sum / chunk.n_finite;
+        chunk.m2 = std::max(0.0, total_sum2 - total_sum * total_sum / chunk.n_finite);
+    }
+    return chunk;
+}
+
+// Combine two partial scans (Chan et al. parallel variance)
+void merge_scan_chunk(ScanChunk &a, const ScanChunk &b)
+{
+    const size_t n = a.n_finite + b.n_finite;
+    if (n > 0) {
+        const double delta = b.mean - a.mean;
+        a.m2 += b.m2 + delta * delta * double(a.n_finite) * double(b.n_finite) / n;
+        a.mean += delta * double(b.n_finite) / n;
+    }
+    a.lo = std::min(a.lo, b.lo);
+    a.hi = std::max(a.hi, b.hi);
+    a.n_finite = n;
+    a.n_nan += b.n_nan;
+    a.n_inf += b.n_inf;
+}
+
+// Merge partial scans into the stats of the whole volume
+VolumeStats stats_from_scan(const std::vector<ScanChunk> &chunks)
+{
+    ScanChunk total;
+    for (const auto &c : chunks) {
+        merge_scan_chunk(total, c);
+    }
+
+    VolumeStats stats;
+    stats.n_finite = total.n_finite;
+    stats.n_nan = total.n_nan;
+    stats.n_inf = total.n_inf;
+    if (total.n_finite > 0) {
+        stats.range = vec2f(total.lo, total.hi);
+        stats.mean = total.mean;
+        stats.variance = total.m2 / total.n_finite;
+    }
+    return stats;
+}
+
+// Scan the voxels in parallel chunks, converting to float into out if it is not null
+template <typename T>
+VolumeStats compute_volume_stats(const T *voxels, size_t n, float *out = nullptr)
+{
+    const size_t n_chunks = (n + SCAN_CHUNK_VOXELS - 1) / SCAN_CHUNK_VOXELS;
+    std::vector<ScanChunk> chunks(n_chunks);
+    rkcommon::tasking::parallel_for(n_chunks, [&](size_t c) {
+        const size_t begin = c * SCAN_CHUNK_VOXELS;
+        const size_t count = std::min(SCAN_CHUNK_VOXELS, n - begin);
+        if (out) {
+            chunks[c] = scan_voxels<T, true>(voxels + begin, out + begin, count);
+        } else {
+            chunks[c] = scan_voxels<T, false>(voxels + begin, nullptr, count);
+        }
+    });
+    return stats_from_scan(chunks);
+}
+
+// Fine enough for the isosurface levels to be picked straight from it
+const int HISTOGRAM_BINS = 4096;
+
+// Histogram of the finite voxels over range, built from per-chunk histograms
+template <typename T>
+std::vector<uint64_t> compute_histogram(const T *voxels, size_t n, const vec2f &range, int n_bins = HISTOGRAM_BINS)
+{
+    const size_t n_chunks = (n + SCAN_CHUNK_VOXELS - 1) / SCAN_CHUNK_VOXELS;
+    std::vector<std::vector<uint64_t>> chunk_bins(n_chunks);
+    const float scale = range.y > range.x ? n_bins / (range.y - range.x) : 0.f;
+    rkcommon::tasking::parallel_for(n_chunks, [&](size_t c) {
+        std::vector<uint64_t> &bins = chunk_bins[c];
+        bins.assign(n_bins, 0);
+        const size_t begin = c * SCAN_CHUNK_VOXELS;
+        const size_t end = std::min(n, begin + SCAN_CHUNK_VOXELS);
+        for (size_t i = begin; i < end; ++i) {
+            const float x = float(voxels[i]);
+            if (std::isfinite(x)) {
+                const int bin = int((x - range.x) * scale);
+                ++bins[std::min(std::max(bin, 0), n_bins - 1)];
+            }
+        }
+    });
+
+    std::vector<uint64_t> histogram(n_bins, 0);
+    for (const auto &bins : chunk_bins) {
+        for (int b = 0; b < n_bins; ++b) {
+            histogram[b] += bins[b];
+        }
+    }
+    return histogram;
+}
+
+// Min/max of every brick of a dense x-fastest volume, one task per brick.
+// With an apron the ranges and NaN/Inf counts also take in that many voxels
+// around each brick, e.g. the voxels its cells share with the next bricks.
+template <typename T>
+BrickRanges compute_brick_ranges(const T *voxels, const vec3i &dims, int brick_size, int apron = 0)
+{
+    BrickRanges bricks;
+    bricks.brick_size = brick_size;
+    bricks.grid = vec3i((dims.x + brick_size - 1) / brick_size,
+                        (dims.y + brick_size - 1) / brick_size,
+                        (dims.z + brick_size - 1) / brick_size);
+    bricks.ranges.resize(size_t(bricks.grid.x) * bricks.grid.y * bricks.grid.z);
+    bricks.n_nan.resize(bricks.ranges.size());
+    bricks.n_inf.resize(bricks.ranges.size());
+    rkcommon::tasking::parallel_for(bricks.ranges.size(), [&](size_t b) {
+        const int bx = int(b % bricks.grid.x);
+        const int by = int((b / bricks.grid.x) % bricks.grid.y);
+        const int bz = int(b / (size_t(bricks.grid.x) * bricks.grid.y));
+        const vec3i lower(std::max(bx * brick_size - apron, 0),
+                          std::max(by * brick_size - apron, 0),
+                          std::max(bz * brick_size - apron, 0));
+        const vec3i upper(std::min(dims.x, (bx + 1) * brick_size + apron),
+                          std::min(dims.y, (by + 1) * brick_size + apron),
+                          std::min(dims.z, (bz + 1) * brick_size + apron));
+        ScanChunk range;
+        for (int z = lower.z; z < upper.z; ++z) {
+            for (int y = lower.y; y < upper.y; ++y) {
+                const T *row = voxels + (size_t(z) * dims.y + y) * dims.x;
+                merge_scan_chunk(range, scan_voxels<T, false>(row + lower.x, nullptr, upper.x - lower.x));
+            }
+        }
+        bricks.ranges[b] = vec2f(range.lo, range.hi);
+        bricks.n_nan[b] = uint32_t(range.n_nan);
+        bricks.n_inf[b] = uint32_t(range.n_inf);
+    });
+    return bricks;
+}
+
+// Seconds elapsed since start
+double seconds_since(const std::chrono::steady_clock::time_point &start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void print_throughput(const std::string &stage, size_t bytes, double seconds)
+{
+    const double gb = bytes / 1e9;
+    std::cout << stage << ": " << gb << " GB in " << seconds << " s";
+    if (seconds > 0.0) {
+        std::cout << " (" << gb / seconds << " GB/s)";
+    }
+    std::cout << std::endl;
+}
+
+void print_volume_stats(const VolumeStats &stats)
+{
+    std::cout << "volume range: " << stats.range << ", mean: " << stats.mean
+              << ", stddev: " << std::sqrt(stats.variance) << std::endl;
+    if (stats.n_nan > 0 || stats.n_inf > 0) {
+        std::cout << "volume has " << stats.n_nan << " NaN and " << stats.n_inf
+                  << " Inf voxels" << std::endl;
+    }
+}